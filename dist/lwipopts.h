@@ -11,6 +11,7 @@
 #define MEM_ALIGNMENT   4
 
 #define MEMP_NUM_TCP_SEG           32
+#define MEMP_NUM_TCP_PCB           16 /* >= NET_MAXSOCK + NET_BACKLOG */
 #define MEMP_NUM_ARP_QUEUE         10
 #define ARP_TABLE_SIZE             10
 #define PBUF_POOL_SIZE             24
@@ -37,10 +38,27 @@
 #define LWIP_UDP                   1
 #define LWIP_DNS                   1
 #define LWIP_TCP_KEEPALIVE         1
+#define TCP_LISTEN_BACKLOG         1
 #define LWIP_NETIF_TX_SINGLE_PBUF  1
 #define DHCP_DOES_ARP_CHECK        0
 #define LWIP_DHCP_DOES_ACD_CHECK   0
 
+/* Incoming packets go through the NET_FILTER rules before lwIP looks at
+   them, see src/net/filter.c. */
+
+struct pbuf;
+struct netif;
+int netfilter_input(struct pbuf *packet, struct netif *iface);
+#define LWIP_HOOK_IP4_INPUT(packet, iface) netfilter_input(packet, iface)
+
+/* DHCP discovers ask for the address from the last lease, see wifi.c. */
+
+struct dhcp_msg;
+void wifi_dhcp_options(struct netif *iface, unsigned char type,
+                       struct dhcp_msg *msg, unsigned short *len);
+#define LWIP_HOOK_DHCP_APPEND_OPTIONS(iface, dhcp, state, msg, type, len)    \
+    wifi_dhcp_options(iface, type, msg, len)
+
 #define LWIP_DEBUG 1
 #define LWIP_STATS 1
 
@@ -0,0 +1,19 @@
+/* host.h - host build support
+   Copyright (c) 2025 bellrise */
+
+#ifndef MICRON_HOST_H
+#define MICRON_HOST_H 1
+
+#include <micron/micron.h>
+
+/* RAM between the end of .bss and the stack on a host build, taken by _sbrk
+   the same way as on the device. */
+#define HOST_RAM_SIZE (256 * 1024)
+
+extern u8 host_ram[HOST_RAM_SIZE];
+
+/* Each core runs on a thread of its own, which has to say which core it is
+   before touching anything kept per core. Threads default to core 0. */
+void host_set_core(u32 core);
+
+#endif /* MICRON_HOST_H */
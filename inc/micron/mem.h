@@ -4,15 +4,22 @@
 #ifndef MICRON_MEM_H
 #define MICRON_MEM_H 1
 
+#include <micron/buildconfig.h>
 #include <micron/micron.h>
 
 #define PAGE_SIZE      1024
 #define PAGE_SIZE_BITS 10
 #define PAGE_SIZE_MASK 0x3FF
 
-#define PF_ALLOC (1 << 0)
-#define PF_USER  (1 << 1)
-#define PF_START (1 << 7)
+#define PF_ALLOC   (1 << 0)
+#define PF_USER    (1 << 1)
+#define PF_SLAB    (1 << 2)
+#define PF_CACHE   (1 << 3)
+#define PF_MOVABLE (1 << 4)
+#define PF_ZERO    (1 << 5) /* page_alloc only, not kept in the pagemap */
+#define PF_START   (1 << 7)
+
+#define BUDDY_ORDERS 16
 
 struct meminfo
 {
@@ -22,15 +29,219 @@ struct meminfo
     u32 n_pages;
     u8 *pagemap;
     u8 *pages_start;
+    u32 used_pages; /* pages handed out by the core, incl. magazines */
+    u32 used_high;  /* high-water mark of used_pages */
+#if MICRON_CONFIG_MEM_BUDDY
+    u8 *ordermap;                   /* block order & state per page */
+    struct buddy_block *free_lists[BUDDY_ORDERS]; /* free blocks per order */
+    u32 n_free[BUDDY_ORDERS];       /* length of each free list */
+#else
+    u32 *freemap;  /* 1 bit per page, set if the page is free */
+    u32 *startmap; /* 1 bit per page, set on the first page of a run */
+    u8 *runmap;    /* longest free run in each freemap word */
+    u32 n_words;   /* number of words in freemap & startmap */
+    u32 free_hint; /* lowest freemap word which may have a free page */
+#endif
+};
+
+struct mem_cache
+{
+    const char *name;
+    usize size;               /* object size, rounded up to align */
+    usize align;              /* object alignment */
+    usize offset;             /* offset of the first object in a slab */
+    u32 slab_pages;           /* pages per slab */
+    u32 per_slab;             /* objects per slab */
+    struct mem_slab *partial; /* slabs with free objects */
+    struct mem_slab *full;    /* slabs without free objects */
+    u32 n_slabs;              /* all slabs */
+    u32 n_empty;              /* slabs without allocated objects */
+    u32 n_active;             /* allocated objects */
+    u32 lock_num;             /* striped spinlock number */
+    struct mem_cache *next;   /* next cache in mem_info() */
+};
+
+struct page_handle
+{
+    u8 *addr;  /* first page, only stable while pinned */
+    u32 pages; /* length of the run */
+    u32 pins;  /* the run is never moved while this is non-zero */
+};
+
+struct memstat
+{
+    u32 pages_total;         /* pages in the page heap */
+    u32 pages_used;          /* allocated pages, incl. magazines */
+    u32 pages_high_water;    /* most pages used at once */
+    u32 largest_free_run;    /* biggest possible page_alloc */
+    u32 frag_permille;       /* 1000 - largest_free_run / free pages */
+    u32 allocs;              /* successful page_alloc calls */
+    u32 frees;               /* successful page_free calls */
+    u32 failures;            /* page_alloc calls which returned NULL */
+    usize malloc_free;       /* bytes left in the malloc heap */
+    usize malloc_high_water; /* most bytes taken from the malloc heap */
+};
+
+#if MICRON_CONFIG_MEM_TRACE
+
+# define MT_ALLOC 1
+# define MT_FREE  2
+# define MT_FAIL  3
+
+struct mem_trace_event
+{
+    u32 time_us;  /* lower 32 bits of time_us_64() */
+    void *caller; /* return address of the page_alloc/page_free call */
+    void *addr;   /* first page, NULL for MT_FAIL */
+    u16 pages;
+    u8 type;      /* MT_ALLOC, MT_FREE or MT_FAIL */
+    u8 core;
+};
+
+#endif
+
+struct mem_arena
+{
+    struct arena_chunk *head; /* first chunk */
+    struct arena_chunk *cur;  /* chunk we're allocating from */
+    usize used;               /* bytes allocated since the last reset */
+    usize high_water;         /* most bytes used between resets */
+    u32 chunk_pages;          /* pages in a new chunk */
 };
 
 i32 _mem_init();
 i32 _mem_close();
 
+/* Hardware spinlock protecting the page heap. Disables interrupts on the
+   calling core, returning the previous state for _mem_unlock. */
+u32 _mem_lock();
+void _mem_unlock(u32 irq);
+
 void mem_info();
 usize malloc_heap_free_left();
 
+/* Snapshot of the page heap & malloc heap statistics. The counters are kept
+   per core and summed here, so they cost nothing on the allocation path. */
+void mem_stat(struct memstat *stat);
+
+#if MICRON_CONFIG_MEM_TRACE
+/* Copy up to n of the latest page_alloc/page_free events recorded on the
+   given core, oldest first. Returns the number of events copied. Each core
+   has a ring of MICRON_CONFIG_MEM_TRACE_EVENTS events, older ones get
+   overwritten. */
+u32 mem_trace_read(u32 core, struct mem_trace_event *events, u32 n);
+void _mem_trace(u8 type, void *addr, u32 pages, void *caller);
+#endif
+
+/* Allocate a contiguous run of pages. Safe to call from both cores; single
+   pages come from a per-core magazine without taking the global lock. With
+   PF_ZERO, the pages are cleared before returning. */
 void *page_alloc(u32 pages, u8 flags);
 i32 page_free(void *addr);
 
+/* Movable page runs. Instead of a pointer, page_alloc_movable returns a
+   handle, and the memory may only be accessed between page_pin and
+   page_unpin. Unpinned runs may be moved by mem_compact, which slides them
+   towards the start of the heap so the free pages form bigger runs. The mem
+   lock is taken for one run at a time. With MICRON_CONFIG_MEM_COMPACT, it is
+   also called by page_alloc on core 0 when no free run is big enough.
+   Returns the number of pages moved. With MICRON_CONFIG_MEM_BUDDY, compaction does
+   nothing, as buddy blocks are already merged when freed. */
+struct page_handle *page_alloc_movable(u32 pages, u8 flags);
+i32 page_free_movable(struct page_handle *handle);
+void *page_pin(struct page_handle *handle);
+void page_unpin(struct page_handle *handle);
+u32 mem_compact();
+
+/* Fill pages with a repeated 32-bit pattern using a DMA channel. The async
+   version returns right after starting the transfer, and the result has to
+   be passed to page_fill_wait before the pages are used. If no channel is
+   free, the pages are filled by the CPU before returning. */
+void page_fill(void *addr, u32 pages, u32 pattern);
+i32 page_fill_async(void *addr, u32 pages, u32 pattern);
+void page_fill_wait(i32 fill);
+
+/* Copy memory with a DMA channel, falling back to memmove if none is free
+   or the buffers are not word-aligned. Overlapping buffers are only allowed
+   if dest is below src. */
+void mem_dma_copy(void *dest, const void *src, usize size);
+
+/* Stack usage. stack_paint fills the unused part of a core's stack with a
+   pattern, and has to be called before the stack is used (boot.c & net_init
+   do this). stack_high_water returns the most bytes the stack has ever used,
+   or 0 if the stack was never painted.
+   With MICRON_CONFIG_STACK_CHECK, stack_check_start sets up a timer which
+   notes once a stack gets within 1/8 of its size. The timer runs in an
+   interrupt, so the warning is only logged by the next stack_report, which
+   net_thread and mem_stat call. */
+void stack_paint(u32 core);
+usize stack_size(u32 core);
+usize stack_high_water(u32 core);
+void stack_check_start();
+void stack_report();
+
+/* Object caches for fixed-size objects, carved out of PF_SLAB pages. The
+   name is not copied, so it should be a string literal. Returns NULL if the
+   alignment is not a power of two or the object doesn't fit in a slab. */
+struct mem_cache *mem_cache_create(const char *name, usize size, usize align);
+void *mem_cache_alloc(struct mem_cache *cache);
+void mem_cache_free(struct mem_cache *cache, void *obj);
+struct mem_cache *mem_cache_of(void *obj);
+void mem_cache_info();
+void _mem_cache_init();
+
+/* General purpose allocator. Requests up to KMALLOC_MAX bytes are served
+   from power-of-two size class caches, bigger ones get their own page run.
+   All pointers are 8-byte aligned, kmemalign takes any power of two up to
+   PAGE_SIZE. Freeing a pointer which is not from the page heap panics. With
+   MICRON_CONFIG_MEM_MALLOC, these also replace malloc, free, realloc,
+   calloc, memalign, aligned_alloc & malloc_usable_size. */
+
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 512
+
+void *kmalloc(usize size);
+void *kcalloc(usize n, usize size);
+void *kmemalign(usize align, usize size);
+void *krealloc(void *ptr, usize size);
+void kfree(void *ptr);
+usize ksize(void *ptr);
+void _kmalloc_init();
+
+/* Most bytes ever held by kmalloc users at once, counting whole size class
+   objects for the small allocations. */
+usize kmalloc_high_water();
+
+/* Scratch memory arenas, backed by chunks of chunk_pages pages. Allocation is
+   a pointer bump, arena_reset frees everything at once in O(1) while keeping
+   the chunks for reuse, and arena_destroy gives them back to the page heap.
+   arena_printf returns a formatted string allocated in the arena. */
+void arena_init(struct mem_arena *arena, u32 chunk_pages);
+void *arena_alloc(struct mem_arena *arena, usize size);
+char *arena_printf(struct mem_arena *arena, const char *fmt, ...)
+    __printflike(2, 3);
+void arena_reset(struct mem_arena *arena);
+usize arena_high_water(struct mem_arena *arena);
+void arena_destroy(struct mem_arena *arena);
+
+/* Page allocator core. page_alloc & page_free manage the pagemap flags, while
+   the core only keeps track of which pages are free. _page_core_alloc returns
+   the index of the first page, or -1 if no run is big enough. _page_core_free
+   returns the length of the freed run. The core is either the bitmap
+   allocator (mem/page.c) or, with MICRON_CONFIG_MEM_BUDDY, the buddy
+   allocator (mem/buddy.c). */
+
+usize _page_core_metasize(u32 n_pages);
+void _page_core_init(u8 *meta);
+i32 _page_core_alloc(u32 pages);
+u32 _page_core_free(u32 index);
+u32 _page_core_largest();
+void _page_core_info();
+
+/* Allocate & free a run in both the core and the pagemap. These have to be
+   called with the mem lock held. */
+
+i32 _mem_core_alloc(u32 pages, u8 flags);
+void _mem_core_free(u32 index);
+
 #endif /* MICRON_MEM_H */
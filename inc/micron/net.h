@@ -10,39 +10,268 @@
 
 # include <lwip/netif.h>
 # include <micron/micron.h>
+# include <micron/ring.h>
 # include <netif/ethernet.h>
+# include <pico/time.h>
 # include <pico/util/queue.h>
 
+# define NET_ZC_SEGMENTS 16
+# define NET_ZC_TX       8
+# define NET_CTRL_RING   16
+# define NET_IDLE_MS     1000
+# define NET_DGRAMS      16
+
+# define NET_RECONNECT_MIN_MS 1000  /* first wait after losing the link */
+# define NET_RECONNECT_MAX_MS 60000 /* the wait doubles up to this */
+# define NET_JOIN_TIMEOUT_MS  15000 /* one reconnect, including DHCP */
+
+struct netctrl_req;
+
+typedef void (*netctrl_done_fn)(struct netctrl_req *req);
+
+/* A single netctrl command. The descriptor is owned by the caller and has to
+   stay valid until done is set, core 1 only keeps a pointer to it in the
+   command ring. */
+struct netctrl_req
+{
+    u32 id;             /* assigned by netctrl_submit */
+    u32 cmd;            /* NC_* command */
+    uptr args[3];       /* command arguments */
+    volatile iptr res;  /* command result, valid once done is set */
+    volatile bool done; /* set by core 1 after the command has run */
+    netctrl_done_fn cb; /* optional, called on core 1 right before done */
+    void *arg;
+};
+
+/* Per-socket part of struct net_stats. */
+struct net_sock_stats
+{
+    u8 id;
+    u8 proto;       /* IP_PROTO_TCP or IP_PROTO_UDP */
+    u16 rbuf_level; /* bytes waiting for net_read */
+    u16 wbuf_level; /* bytes waiting to be sent */
+    u16 backlog;    /* clients waiting for net_accept */
+    u32 rx_bytes;
+    u32 tx_bytes;
+    u32 rx_drops; /* datagrams which didn't fit */
+};
+
+/* Network counters, published by the network thread once per iteration. */
+struct net_stats
+{
+    u32 rx_bytes;        /* received on netsocks */
+    u32 tx_bytes;        /* sent on netsocks */
+    u32 tx_segments;     /* TCP segments sent */
+    u32 tx_responses;    /* writes ended by a flush/close */
+    u32 accepts;         /* connections queued for net_accept */
+    u32 accept_drops;    /* connections refused */
+    u32 rx_drops;        /* datagrams dropped */
+    u32 icmp_replies;    /* echo replies sent */
+    u32 icmp_limited;    /* echo requests over NET_ICMP_RATE */
+    u32 icmp_drops;      /* other ICMP packets dropped */
+    u32 doorbell_avg_us; /* doorbell to the work handed to lwIP */
+    u32 doorbell_max_us;
+    u32 link_xmit; /* lwIP LINK_STATS */
+    u32 link_recv;
+    u32 link_drop;
+    u32 link_err;
+    u32 lwip_mem_used; /* lwIP MEM_STATS */
+    u32 lwip_mem_max;
+    u32 lwip_mem_err;
+    u32 link_up;           /* 1 while the link is up */
+    u32 link_outages;      /* times the link was lost */
+    u32 link_outage_ms;    /* time spent without a link, summed */
+    u32 link_outage_max_ms;
+    u32 wifi_ip_ms;     /* boot: Wi-Fi start to a DHCP address */
+    u32 wifi_fast_join; /* boot: 1 if the scan was skipped */
+    u32 nsocks; /* valid entries in socks */
+    struct net_sock_stats socks[MICRON_CONFIG_NET_MAXSOCK];
+};
+
+struct net;
+
+/* Network interface backend, which brings up the lwIP interface and drives
+   it from the network thread. On the board this is the CYW43 radio, on a
+   host the in-memory loopback. */
+struct net_backend
+{
+    const char *name;
+    i32 (*init)(struct net *);                    /* set up net->iface */
+    void (*start)(struct net *, void (*thread)()); /* run the network thread */
+    i32 (*link)(struct net *);  /* > 0 up with an address, < 0 failed */
+    void (*poll)(struct net *); /* work the driver & the lwIP timers */
+    void (*wait)(struct net *, absolute_time_t until); /* sleep until work */
+    void (*wake)(struct net *); /* end wait early, called from core 0 */
+    void (*reconnect)(struct net *, u32 attempt); /* start joining again */
+};
+
+/* Link state machine in net_thread. */
+enum net_link_state
+{
+    NET_LINK_UP,      /* link up, with an address */
+    NET_LINK_DOWN,    /* lost, waiting for link_next to reconnect */
+    NET_LINK_JOINING, /* reconnecting, gives up at link_next */
+};
+
+extern const struct net_backend net_cyw43_backend;
+extern const struct net_backend net_loopback_backend;
+
+struct wifi_radio;
+
 struct net
 {
+    const struct net_backend *backend;
     struct netif *iface;     /* lwip interface */
     const char *w_ssid;      /* wlan SSID */
     struct eth_addr w_bssid; /* wlan BSSID */
     i32 w_found_networks;    /* wlan found matching networks */
     bool w_connected;        /* true for connected wlan */
-    queue_t netctrl;         /* control queue */
-    queue_t ctrlres;         /* reply queue */
-    u32 last_netsock_id;
-    i32 nsocks;
-    struct netsock *socks[32]; /* open netsocks */
-    u32 netsock_rx;            /* RX on netsocks */
-    u32 netsock_tx;            /* TX on netsocks */
+    const struct wifi_radio *w_radio; /* radio driven by wifi_connect */
+    u16 w_channel;                    /* wlan channel */
+    bool w_fast_join;                 /* joined without scanning */
+    u32 w_ip_ms;                      /* wifi_init to a DHCP address */
+    struct ring ctrl;        /* netctrl requests, drained by core 1 */
+    spin_lock_t *ctrl_lock;  /* serializes the ctrl producers */
+    u32 last_ctrl_id;
+    u32 sock_free;                 /* bitmap of free socks slots */
+    struct netsock *socks[MICRON_CONFIG_NET_MAXSOCK]; /* by netsock id */
+    u32 netsock_rx;                /* RX on netsocks */
+    u32 netsock_tx;                /* TX on netsocks */
+    struct mem_cache *sock_cache;  /* struct netsock objects */
+    struct mem_cache *rwbuf_cache; /* rbuf/wbuf storage */
+    volatile u32 event_seq;        /* bumped by core 1 on socket changes */
+    struct netctrl_req *ctrl_data[NET_CTRL_RING];
+    volatile bool doorbell_rung;          /* set by core 0, cleared by core 1 */
+    volatile u32 doorbell_at;             /* time_us_32 of the first ring */
+    u32 doorbell_count;                   /* doorbells handled */
+    u32 doorbell_total_us;                /* doorbell to lwIP, summed */
+    u32 doorbell_max_us;                  /* doorbell to lwIP, worst case */
+    u32 tx_segments;                      /* TCP segments sent by netsocks */
+    u32 tx_responses;                     /* writes ended by a flush/close */
+    u32 accepts;                          /* connections queued for accept */
+    u32 accept_drops;                     /* connections refused */
+    u32 rx_drops;                         /* datagrams dropped */
+    u32 icmp_credit_us;                   /* ICMP token bucket */
+    u32 icmp_refill_at;                   /* time_us_32 of the last refill */
+    u32 icmp_replies;                     /* echo replies sent */
+    u32 icmp_limited;                     /* echo requests over the rate */
+    u32 icmp_drops;                       /* other ICMP packets dropped */
+    enum net_link_state link_state;
+    u32 link_backoff_ms;                  /* wait before the next reconnect */
+    u32 link_attempts;                    /* reconnects since the link loss */
+    absolute_time_t link_next;            /* reconnect at, or give up at */
+    absolute_time_t link_lost_at;
+    u32 link_outages;                     /* times the link was lost */
+    u32 link_outage_ms;                   /* time without a link, summed */
+    u32 link_outage_max_ms;               /* longest outage */
+    volatile u32 stats_seq;               /* odd while stats is written */
+    struct net_stats stats;               /* published by core 1 */
+};
+
+typedef void (*net_done_fn)(void *arg);
+
+/* Zero-copy transmit buffer, queued by net_write_zc. */
+struct net_zc_tx
+{
+    const u8 *buf;
+    u32 len;
+    u32 wbuf_mark;    /* wbuf head at the time of the call */
+    u32 end;          /* tx_written after the last byte of buf */
+    net_done_fn done; /* called on core 1 once buf is acknowledged */
+    void *arg;
+};
+
+/* Datagram descriptor. On receive, the dgrams ring holds one for each
+   datagram in rbuf, on transmit each datagram in wbuf is prefixed by one. */
+struct net_dgram
+{
+    ip_addr_t addr; /* source or destination address */
+    u16 port;       /* source or destination port */
+    u16 len;        /* payload bytes */
+};
+
+/* A single datagram for net_sendmmsg. */
+struct net_msg
+{
+    const void *buf;
+    usize len;
+    ip_addr_t addr;
+    u16 port;
 };
 
 struct netsock
 {
     u8 id;
-    queue_t rbuf;
-    queue_t wbuf;
+    u32 flags;        /* NS_* flags, inherited by accepted sockets */
+    struct ring rbuf; /* filled by core 1, read by net_read */
+    struct ring wbuf; /* filled by net_write, sent by core 1 */
     ip_addr_t addr;
     u16 port;
-    bool connected;
-    bool waiting_for_client;
-    queue_t waiting_client;
+    volatile bool connected; /* polled by net_read & net_write */
+    volatile i32 error;      /* why the connection ended, e.g. EPIPE */
+    bool accepted;           /* picked up by net_accept, set by core 0 */
+    bool backlogged;         /* counted in the lwIP listen backlog */
+    queue_t waiting_client;  /* accepted clients, up to NET_BACKLOG */
+    uptr waiting_client_data[MICRON_CONFIG_NET_BACKLOG + 1];
     struct tcp_pcb *tcp;
+    struct udp_pcb *udp;    /* set instead of tcp for UDP sockets */
+    struct ring dgrams;     /* received datagram descriptors, UDP only */
     struct net *net;
-    u8 *tmpbuf;
     u32 packet_read_offset;
+    struct ring zc_rx;      /* received pbuf segments, for net_recv_zc */
+    struct ring zc_release; /* segments given back by net_recv_release */
+    struct pbuf *zc_pending; /* rest of the chain which didn't fit zc_rx */
+    u32 zc_held;             /* segments pushed to zc_rx, not yet collected */
+    struct pbuf *zc_rx_data[NET_ZC_SEGMENTS];
+    struct pbuf *zc_release_data[NET_ZC_SEGMENTS];
+    struct ring zc_tx;   /* net_write_zc buffers, written & unacknowledged */
+    u32 zc_tx_next;      /* next zc_tx entry to pass to tcp_write */
+    u32 zc_tx_offset;    /* bytes of zc_tx_next already written */
+    u32 tx_written;      /* bytes passed to tcp_write */
+    u32 tx_acked;        /* bytes acknowledged by the peer */
+    bool closing;        /* net_close was called, waiting for the data */
+    bool listening;      /* net_bind was called, accepts connections */
+    volatile bool corked;    /* hold back partial segments, see net_cork */
+    volatile u32 flushes;    /* net_flush calls, counted on core 0 */
+    u32 flushes_seen;        /* flushes handled by core 1 */
+    u32 tx_response_mark;    /* tx_written at the end of the last response */
+    u32 rx_bytes;            /* bytes received */
+    u32 rx_drops;            /* datagrams dropped */
+    struct net_zc_tx zc_tx_data[NET_ZC_TX];
+    struct net_dgram dgrams_data[NET_DGRAMS];
+};
+
+enum netsock_flags
+{
+    NS_ZEROCOPY = 1, /* receive with net_recv_zc instead of net_read */
+    NS_NONBLOCK = 2, /* return EAGAIN instead of blocking */
+    NS_NODELAY = 4,  /* disable Nagle, like TCP_NODELAY */
+};
+
+enum net_poll_events
+{
+    NP_READ = 1,   /* net_read or net_recv_zc won't block */
+    NP_WRITE = 2,  /* net_write has space for at least one byte */
+    NP_ACCEPT = 4, /* net_accept has a client ready */
+    NP_CLOSED = 8, /* the connection is gone, always reported */
+};
+
+struct net_pollfd
+{
+    struct netsock *sock;
+    u16 events;  /* NP_* events to wait for */
+    u16 revents; /* NP_* events which are ready */
+};
+
+/* A single received segment, pointing straight into the lwIP pbuf. It has
+   to be given back with net_recv_release, which is also when the TCP window
+   is opened again for its length. */
+struct net_view
+{
+    const void *data;
+    usize len;
+    struct pbuf *seg;
+    struct netsock *sock;
 };
 
 enum netctrl_cmd
@@ -50,16 +279,17 @@ enum netctrl_cmd
     NC_SOCKET = 1,  /* socket() -> sock */
     NC_CONNECT = 2, /* connect(sock, ip, port) -> i32 */
     NC_BIND = 3,    /* bind(sock, ip, port) -> i32 */
-    NC_ACCEPT = 4,  /* accept(sock) -> sock */
-    NC_STAT = 5,    /* xstat(value) -> u32 */
     NC_CLOSE = 6,   /* close(sock) -> i32 */
+    NC_UDP = 7,     /* socket_udp() -> sock */
 };
 
-enum netctrl_stat
-{
-    NCSTAT_RX = 1, /* received bytes */
-    NCSTAT_TX = 2, /* send bytes */
-};
+/* Queue a netctrl command without waiting for it, returning its request ID.
+   Blocks only if the command ring is full. Core 1 runs all queued commands
+   at once, in order, on its next iteration. */
+u32 netctrl_submit(struct netctrl_req *req);
+
+/* Wait until the request is done, and return its result. */
+iptr netctrl_wait(struct netctrl_req *req);
 
 /* Initialize the TCP/IP stack, and start the network thread on
    the second core. */
@@ -67,17 +297,98 @@ i32 net_init();
 
 ip_addr_t net_iface_ip();
 
-u32 net_rx();
-u32 net_tx();
+/* Copy the latest network counters. This doesn't wait for the network
+   thread, the stats block is shared and protected by a sequence count. */
+void net_stat(struct net_stats *stats);
+
+/* Wake up the network thread, because there is new work for it. Called by
+   the core 0 API after queuing commands or data. */
+void net_doorbell(struct net *);
 
 struct netsock *net_socket();
 
+/* Create a UDP socket. It can send right away, and receives datagrams once
+   bound with net_bind. net_read and net_write don't work on it, datagrams
+   go through net_sendto and net_recvfrom. */
+struct netsock *net_socket_udp();
+
+/* Send a single datagram. Blocks until it fits in the write buffer, or
+   returns -EAGAIN with NS_NONBLOCK. A datagram which can never fit returns
+   -EINVAL. */
+i32 net_sendto(struct netsock *, const void *buf, usize len, ip_addr_t addr,
+               u16 port);
+
+/* Queue n datagrams at once, waking up the network thread only once. Returns
+   the number of datagrams queued, which with NS_NONBLOCK may be less than n,
+   or -EAGAIN if none fit. */
+iptr net_sendmmsg(struct netsock *, const struct net_msg *msgs, u32 n);
+
+/* Receive a single datagram, storing up to size bytes of it in buffer and
+   dropping the rest. Returns the length of the whole datagram, and fills in
+   the sender if addr or port are not NULL. Blocks until a datagram arrives,
+   or returns -EAGAIN with NS_NONBLOCK. */
+iptr net_recvfrom(struct netsock *, void *buffer, usize size, ip_addr_t *addr,
+                  u16 *port);
+
+/* Wait for a new connection. Listening sockets accept up to NET_BACKLOG
+   connections on their own, net_accept just takes the oldest one. With
+   NS_NONBLOCK, returns NULL if there is no client waiting yet. Also returns
+   NULL once the socket stopped listening, for example when it couldn't be
+   moved to a new address after the link came back; the socket is left with
+   an error and should be closed. */
 struct netsock *net_accept(struct netsock *);
 i32 net_connect(struct netsock *, ip_addr_t ip, u16 port);
 i32 net_bind(struct netsock *, ip_addr_t ip, u16 port);
-usize net_read(struct netsock *, void *buffer, usize size);
-usize net_write(struct netsock *, const void *buffer, usize size);
+
+/* Read whatever is available, up to size bytes. Blocks only until the first
+   byte arrives, and returns 0 once the connection is closed. net_read_full
+   blocks until all size bytes have been read, or the connection is closed.
+   With NS_NONBLOCK, both return -EAGAIN instead of blocking when there is
+   nothing to read. A connection lost with the link returns -EPIPE instead
+   of 0. */
+iptr net_read(struct netsock *, void *buffer, usize size);
+iptr net_read_full(struct netsock *, void *buffer, usize size);
+
+/* Write all size bytes, blocking while the write buffer is full. With
+   NS_NONBLOCK, write as much as fits, or return -EAGAIN if nothing does.
+   Returns -EPIPE if nothing was written because the link was lost. */
+iptr net_write(struct netsock *, const void *buffer, usize size);
 i32 net_close(struct netsock *);
 
+/* Wait until one of the sockets is ready for the requested events, or for
+   timeout_ms (-1 waits forever, 0 only checks). Returns the number of
+   sockets with non-zero revents. */
+i32 net_poll(struct net_pollfd *fds, u32 n, i32 timeout_ms);
+
+/* Zero-copy receive, for sockets with NS_ZEROCOPY. net_recv_zc blocks until
+   a segment is available (or returns -EAGAIN with NS_NONBLOCK), returning
+   -EPIPE once the connection is closed and all segments have been read. Every
+   view has to be released before the socket is closed. */
+i32 net_recv_zc(struct netsock *, struct net_view *view);
+void net_recv_release(struct net_view *view);
+
+/* Send buf without copying it. The buffer has to stay valid and unchanged
+   until done(arg) is called, which happens on core 1 once the peer has
+   acknowledged all of it, or the connection is gone. The data goes out after
+   anything written before with net_write. Returns -EPIPE if the socket is
+   not connected, and -EAGAIN with NS_NONBLOCK if too many buffers are
+   queued. */
+i32 net_write_zc(struct netsock *, const void *buf, usize len,
+                 net_done_fn done, void *arg);
+
+/* Cork the socket: written data is only sent in full segments, until
+   net_flush sends the rest. Use it around a response made of several writes,
+   so it goes out in as few segments as possible. net_close flushes too. */
+void net_cork(struct netsock *);
+void net_flush(struct netsock *);
+
+/* Set the NS_* flags of a socket. A listening socket passes its flags on to
+   the accepted ones, so set them before net_accept. */
+void net_setflags(struct netsock *, u32 flags);
+
+/* Update an Internet checksum after one 16-bit word of the data changed from
+   old to new, without summing the rest again. Used for echo replies. */
+u16 net_chksum_adjust(u16 sum, u16 old, u16 new);
+
 #endif /* MICRON_CONFIG_NET */
 #endif /* MICRON_NET_H */
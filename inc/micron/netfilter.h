@@ -5,7 +5,37 @@
 #define MICRON_NETFILTER_H 1
 
 #include <lwip/ip.h>
+#include <micron/buildconfig.h>
+#include <micron/micron.h>
 
-bool netfilter_lan_addr(const ip_addr_t *addr);
+/* A single NET_FILTER rule, as compiled by mkgenconfig. */
+struct netfilter_rule
+{
+    const char *name; /* the rule as written in the config */
+    bool allow;
+    u8 proto; /* IP_PROTO_*, 0 for any */
+    u16 port_lo;
+    u16 port_hi;
+};
+
+/* Addresses from lo to hi (host byte order) are covered by the rules listed
+   in netfilter_matches[first..first+count], in the order they're tried. */
+struct netfilter_range
+{
+    u32 lo;
+    u32 hi;
+    u16 first;
+    u16 count;
+};
+
+/* lwIP input hook, see LWIP_HOOK_IP4_INPUT in lwipopts.h. Returns 1 and
+   frees the packet if it was dropped. */
+int netfilter_input(struct pbuf *packet, struct netif *iface);
+
+/* Number of rules, including the last one for packets no rule matched. */
+u32 netfilter_nrules();
+
+/* Name of the rule and how many packets it matched. */
+const char *netfilter_rule(u32 rule, u32 *hits);
 
 #endif /* MICRON_NETFILTER_H */
@@ -0,0 +1,171 @@
+/* ring.h - single-producer single-consumer ring buffers
+   Copyright (c) 2025 bellrise */
+
+#ifndef MICRON_RING_H
+#define MICRON_RING_H 1
+
+#include <hardware/sync.h>
+#include <micron/micron.h>
+#include <string.h>
+
+/* A ring shared between exactly one producer and one consumer, usually on
+   different cores. The producer only ever writes head, and the consumer only
+   writes tail, so no lock is needed. Both counters run freely and wrap
+   around, the slot is picked by masking with count - 1, which is why count
+   has to be a power of two. The memory barriers make sure the elements are
+   written before the new head is seen, and read before the new tail frees
+   their slots. */
+
+struct ring
+{
+    u8 *data;
+    u32 count;         /* number of elements, a power of two */
+    u32 element_size;  /* bytes per element */
+    volatile u32 head; /* elements written by the producer */
+    volatile u32 tail; /* elements read by the consumer */
+};
+
+static inline void ring_init(struct ring *ring, void *data, u32 count,
+                             u32 element_size)
+{
+    ring->data = data;
+    ring->count = count;
+    ring->element_size = element_size;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+static inline u32 ring_level(const struct ring *ring)
+{
+    return ring->head - ring->tail;
+}
+
+static inline u32 ring_space(const struct ring *ring)
+{
+    return ring->count - ring_level(ring);
+}
+
+static inline bool ring_is_empty(const struct ring *ring)
+{
+    return ring->head == ring->tail;
+}
+
+static inline void *ring_slot(const struct ring *ring, u32 index)
+{
+    return ring->data + (index & (ring->count - 1)) * ring->element_size;
+}
+
+/* Producer side. ring_write_ptr returns the longest contiguous run of free
+   slots (at most up to the end of the buffer), which can be filled in place
+   and published with ring_commit. */
+
+static inline void *ring_write_ptr(struct ring *ring, u32 *n)
+{
+    u32 head;
+
+    head = ring->head;
+    *n = imin(ring_space(ring), ring->count - (head & (ring->count - 1)));
+
+    /* The consumer has to be done with the slots before we reuse them. */
+    __dmb();
+
+    return ring_slot(ring, head);
+}
+
+static inline void ring_commit(struct ring *ring, u32 n)
+{
+    __dmb();
+    ring->head += n;
+}
+
+static inline u32 ring_write(struct ring *ring, const void *src, u32 n)
+{
+    u32 written;
+    u32 len;
+    void *dest;
+
+    written = 0;
+
+    /* At most two copies, one up to the end of the buffer and the other from
+       the start. */
+
+    while (written < n) {
+        dest = ring_write_ptr(ring, &len);
+        if (!len)
+            break;
+
+        len = imin(len, n - written);
+        memcpy(dest, (const u8 *) src + written * ring->element_size,
+               len * ring->element_size);
+        ring_commit(ring, len);
+        written += len;
+    }
+
+    return written;
+}
+
+/* Consumer side, the same in reverse: ring_read_ptr returns the longest
+   contiguous run of elements, and ring_consume frees their slots. */
+
+static inline void *ring_read_ptr(struct ring *ring, u32 *n)
+{
+    u32 tail;
+
+    tail = ring->tail;
+    *n = imin(ring_level(ring), ring->count - (tail & (ring->count - 1)));
+
+    /* Don't read the elements before seeing the head which published them. */
+    __dmb();
+
+    return ring_slot(ring, tail);
+}
+
+static inline void ring_consume(struct ring *ring, u32 n)
+{
+    __dmb();
+    ring->tail += n;
+}
+
+/* Copy up to n elements without consuming them. */
+static inline u32 ring_peek(const struct ring *ring, void *dest, u32 n)
+{
+    u32 first;
+    u32 tail;
+
+    tail = ring->tail;
+    n = imin(n, ring_level(ring));
+    first = imin(n, ring->count - (tail & (ring->count - 1)));
+
+    __dmb();
+
+    memcpy(dest, ring_slot(ring, tail), first * ring->element_size);
+    memcpy((u8 *) dest + first * ring->element_size, ring->data,
+           (n - first) * ring->element_size);
+
+    return n;
+}
+
+static inline u32 ring_read(struct ring *ring, void *dest, u32 n)
+{
+    u32 read;
+    u32 len;
+    void *src;
+
+    read = 0;
+
+    while (read < n) {
+        src = ring_read_ptr(ring, &len);
+        if (!len)
+            break;
+
+        len = imin(len, n - read);
+        memcpy((u8 *) dest + read * ring->element_size, src,
+               len * ring->element_size);
+        ring_consume(ring, len);
+        read += len;
+    }
+
+    return read;
+}
+
+#endif /* MICRON_RING_H */
@@ -6,10 +6,67 @@
 
 #include <micron/net.h>
 
+#define WIFI_FAST_TIMEOUT_MS 3000  /* join using the cached BSSID */
+#define WIFI_JOIN_TIMEOUT_MS 10000 /* join after a scan */
+#define WIFI_RETRY_MAX_MS    16000 /* longest wait between wifi_connect */
+
+#define WIFI_JOINING 0 /* radio->status: still joining, or waiting for DHCP */
+#define WIFI_UP      1 /* radio->status: joined, with an address */
+
+/* The access point we joined last time, kept in flash so the next boot can
+   skip the scan. */
+struct wifi_cache
+{
+    u32 magic;
+    char ssid[33];
+    u8 bssid[6];
+    u16 channel;
+    u32 addr; /* last DHCP address, asked for again */
+    u32 sum;
+};
+
+/* Best access point found by radio->scan. */
+struct wifi_scan
+{
+    u8 bssid[6];
+    u16 channel;
+    i16 rssi;
+};
+
+/* The radio as seen by wifi_connect. Everything is called from the thread
+   running wifi_connect, so a mock radio can drive it on a host. */
+struct wifi_radio
+{
+    /* Scan for net->w_ssid, returning ENOENT if it's not around. */
+    i32 (*scan)(struct net *, struct wifi_scan *best);
+
+    /* Start joining the network. bssid may be NULL, and channel 0 for any. */
+    i32 (*join)(struct net *, const u8 *bssid, u16 channel);
+
+    /* WIFI_JOINING, WIFI_UP or a negative errno once the join failed. */
+    i32 (*status)(struct net *);
+
+    void (*leave)(struct net *);
+
+    /* Let the radio work until there is something new, or until. */
+    void (*wait)(struct net *, absolute_time_t until);
+
+    /* Flash cache, load returns ENOENT if there is nothing stored. */
+    i32 (*load)(struct wifi_cache *cache);
+    void (*save)(const struct wifi_cache *cache);
+};
+
+extern const struct wifi_radio wifi_cyw43_radio;
+
 /* Scan & connect to Wi-Fi using net->ssid & CONFIG_NET_PASSWD. */
 i32 wifi_connect(struct net *net);
 
 /* Initialize Wi-Fi setup in net device. */
 i32 wifi_init(struct net *net);
 
+/* lwIP DHCP hook, asks for the address from the last lease. */
+struct dhcp_msg;
+void wifi_dhcp_options(struct netif *iface, u8 type, struct dhcp_msg *msg,
+                       u16 *len);
+
 #endif /* MICRON_WIFI_H */
@@ -5,22 +5,28 @@
 #include <micron/mem.h>
 #include <micron/micron.h>
 #include <micron/syslog.h>
-#include <pico/bootrom.h>
+#include <pico.h>
 #include <pico/printf.h>
 #include <pico/stdio.h>
-#include <pico/stdio_usb.h>
 #include <pico/time.h>
 
+#if PICO_ON_DEVICE
+# include <pico/bootrom.h>
+# include <pico/stdio_usb.h>
+#endif
+
 extern void user_main();
 
 int main()
 {
     /* Initialize the system */
 
+    stack_paint(0);
     _mem_init();
 
-    /* Initialize connection */
+    /* Initialize connection. Host builds just print to stdout. */
 
+#if PICO_ON_DEVICE
     stdio_usb_init();
     stdio_set_driver_enabled(&stdio_usb, true);
     stdio_filter_driver(&stdio_usb);
@@ -28,16 +34,24 @@ int main()
 
     while (MICRON_CONFIG_WAITUSB && !stdio_usb_connected())
         sleep_ms(50);
+#endif
 
     syslog(LOG_BOLD "Micron " MICRON_STRVER);
 
     mem_info();
 
+    if (MICRON_CONFIG_STACK_CHECK && PICO_ON_DEVICE)
+        stack_check_start();
+
     /* Enter "user mode" */
 
     user_main();
 
-    /* If we happen to exit user mode, just reboot the board. */
+    /* If we happen to exit user mode, just reboot the board. On a host, the
+       program is done. */
 
+#if PICO_ON_DEVICE
     reset_usb_boot(0, 0);
+#endif
+    return 0;
 }
@@ -0,0 +1,30 @@
+/* host/ram.c - RAM for host builds
+   Copyright (c) 2025 bellrise */
+
+#include <micron/host.h>
+#include <micron/mem.h>
+#include <pico.h>
+
+#if !PICO_ON_DEVICE
+
+/* On the device, _sbrk moves from the end of .bss up to the stack limit,
+   and the page heap is the first thing taken from it. Host builds get a
+   block of the same size as the RP2040 RAM, laid out the same way. */
+
+u8 host_ram[HOST_RAM_SIZE] __aligned(PAGE_SIZE);
+
+void *_sbrk(i32 incr)
+{
+    static usize brk;
+    void *prev;
+
+    if ((iptr) brk + incr < 0 || brk + incr > HOST_RAM_SIZE)
+        return (void *) -1;
+
+    prev = host_ram + brk;
+    brk += incr;
+
+    return prev;
+}
+
+#endif /* !PICO_ON_DEVICE */
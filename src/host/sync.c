@@ -0,0 +1,98 @@
+/* host/sync.c - hardware_sync for host builds
+   Copyright (c) 2025 bellrise */
+
+#include <hardware/sync.h>
+#include <micron/host.h>
+#include <pico.h>
+
+#if !PICO_ON_DEVICE
+
+# include <sched.h>
+
+/* The SDK host platform only ever runs core 0: its spin locks don't lock,
+   and get_core_num is always 0. Micron runs the other core on a pthread, so
+   these replace the weak SDK versions with real ones. There are no
+   interrupts to disable, the SDK can keep those. */
+
+static spin_lock_t host_locks[32];
+static _Thread_local u32 host_core;
+
+void host_set_core(u32 core)
+{
+    host_core = core;
+}
+
+uint get_core_num()
+{
+    return host_core;
+}
+
+spin_lock_t *spin_lock_instance(uint lock_num)
+{
+    return &host_locks[lock_num];
+}
+
+uint spin_lock_get_num(spin_lock_t *lock)
+{
+    return lock - host_locks;
+}
+
+spin_lock_t *spin_lock_init(uint lock_num)
+{
+    spin_lock_t *lock;
+
+    lock = spin_lock_instance(lock_num);
+    spin_unlock_unsafe(lock);
+    return lock;
+}
+
+void spin_lock_unsafe_blocking(spin_lock_t *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+void spin_unlock_unsafe(spin_lock_t *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+uint32_t spin_lock_blocking(spin_lock_t *lock)
+{
+    uint32_t irq;
+
+    irq = save_and_disable_interrupts();
+    spin_lock_unsafe_blocking(lock);
+    return irq;
+}
+
+void spin_unlock(spin_lock_t *lock, uint32_t irq)
+{
+    spin_unlock_unsafe(lock);
+    restore_interrupts(irq);
+}
+
+bool is_spin_locked(spin_lock_t *lock)
+{
+    return __atomic_load_n(lock, __ATOMIC_RELAXED);
+}
+
+/* Waiting for an event may return early on the device too, so yielding is
+   enough. The fences are real, as the cores are real threads. */
+
+void __sev()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void __wfe()
+{
+    sched_yield();
+}
+
+void __dmb()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#endif /* !PICO_ON_DEVICE */
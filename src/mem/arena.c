@@ -0,0 +1,164 @@
+/* mem/arena.c - scratch memory arenas
+   Copyright (c) 2025 bellrise */
+
+#include <micron/mem.h>
+#include <pico/printf.h>
+#include <stdarg.h>
+
+/* An arena is a chain of page runs (chunks), each starting with a struct
+   arena_chunk header. Allocating just bumps the offset in the current chunk,
+   moving on to the next one when it's full. Resetting rewinds to the first
+   chunk, but keeps the chain, so the next round of allocations doesn't need
+   to go through page_alloc again. */
+
+#define ARENA_ALIGN 8
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    usize size;   /* usable bytes, including the header */
+    usize offset; /* next free byte */
+};
+
+static inline usize arena_align(usize size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static inline usize chunk_header()
+{
+    return arena_align(sizeof(struct arena_chunk));
+}
+
+static struct arena_chunk *chunk_create(struct mem_arena *arena, usize size)
+{
+    struct arena_chunk *chunk;
+    u32 pages;
+
+    pages = (chunk_header() + size + PAGE_SIZE - 1) >> PAGE_SIZE_BITS;
+    if (pages < arena->chunk_pages)
+        pages = arena->chunk_pages;
+
+    chunk = page_alloc(pages, PF_USER);
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = pages << PAGE_SIZE_BITS;
+    chunk->offset = chunk_header();
+
+    return chunk;
+}
+
+void arena_init(struct mem_arena *arena, u32 chunk_pages)
+{
+    arena->head = NULL;
+    arena->cur = NULL;
+    arena->used = 0;
+    arena->high_water = 0;
+    arena->chunk_pages = chunk_pages ? chunk_pages : 1;
+}
+
+void *arena_alloc(struct mem_arena *arena, usize size)
+{
+    struct arena_chunk *chunk;
+    struct arena_chunk *next;
+    void *ptr;
+
+    size = arena_align(size);
+    chunk = arena->cur;
+
+    if (!chunk || chunk->offset + size > chunk->size) {
+        next = chunk ? chunk->next : arena->head;
+
+        /* Reuse the next chunk in the chain if the allocation fits, otherwise
+           put a new, big enough chunk in front of it. */
+
+        if (next && chunk_header() + size <= next->size) {
+            next->offset = chunk_header();
+        } else {
+            if (!(next = chunk_create(arena, size)))
+                return NULL;
+            next->next = chunk ? chunk->next : arena->head;
+            if (chunk)
+                chunk->next = next;
+            else
+                arena->head = next;
+        }
+
+        arena->cur = chunk = next;
+    }
+
+    ptr = (u8 *) chunk + chunk->offset;
+    chunk->offset += size;
+    arena->used += size;
+
+    if (arena->used > arena->high_water)
+        arena->high_water = arena->used;
+
+    return ptr;
+}
+
+char *arena_printf(struct mem_arena *arena, const char *fmt, ...)
+{
+    struct arena_chunk *chunk;
+    va_list args;
+    usize left;
+    char *str;
+    i32 len;
+
+    /* Try to format straight into the free space of the current chunk, and
+       only if that doesn't fit allocate the exact size and format again. */
+
+    chunk = arena->cur;
+    left = chunk ? chunk->size - chunk->offset : 0;
+
+    va_start(args, fmt);
+    len = vsnprintf(left ? (char *) chunk + chunk->offset : NULL, left, fmt,
+                    args);
+    va_end(args);
+
+    if (len < 0)
+        return NULL;
+    if (arena_align(len + 1) <= left)
+        return arena_alloc(arena, len + 1);
+
+    if (!(str = arena_alloc(arena, len + 1)))
+        return NULL;
+
+    va_start(args, fmt);
+    vsnprintf(str, len + 1, fmt, args);
+    va_end(args);
+
+    return str;
+}
+
+void arena_reset(struct mem_arena *arena)
+{
+    /* Rewind to the first chunk, the rest get their offsets reset once we
+       move into them. */
+
+    if (arena->head)
+        arena->head->offset = chunk_header();
+
+    arena->cur = arena->head;
+    arena->used = 0;
+}
+
+usize arena_high_water(struct mem_arena *arena)
+{
+    return arena->high_water;
+}
+
+void arena_destroy(struct mem_arena *arena)
+{
+    struct arena_chunk *chunk;
+    struct arena_chunk *next;
+
+    for (chunk = arena->head; chunk; chunk = next) {
+        next = chunk->next;
+        page_free(chunk);
+    }
+
+    arena_init(arena, arena->chunk_pages);
+}
@@ -0,0 +1,267 @@
+/* mem/buddy.c - buddy page allocator core
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/mem.h>
+#include <micron/syslog.h>
+
+#if MICRON_CONFIG_MEM_BUDDY
+
+/* Each block head in the ordermap stores the block order in the lower bits,
+   and the state in the upper bits. Pages inside a block are left at zero. An
+   allocated run is made out of one or more blocks, the last of which has the
+   BF_LAST bit set, so page_free knows where to stop. */
+
+# define BF_ORDER 0x1F
+# define BF_FREE  (1 << 5)
+# define BF_ALLOC (1 << 6)
+# define BF_LAST  (1 << 7)
+
+struct buddy_block
+{
+    struct buddy_block *next;
+    struct buddy_block *prev;
+};
+
+extern struct meminfo __micron_meminfo;
+
+static inline struct buddy_block *block_at(u32 index)
+{
+    return (struct buddy_block *) (__micron_meminfo.pages_start
+                                   + (index << PAGE_SIZE_BITS));
+}
+
+static inline u32 block_index(struct buddy_block *block)
+{
+    return ((uptr) block - (uptr) __micron_meminfo.pages_start)
+        >> PAGE_SIZE_BITS;
+}
+
+static void list_push(u32 index, u32 order)
+{
+    struct buddy_block *block;
+    struct meminfo *info;
+
+    info = &__micron_meminfo;
+    block = block_at(index);
+
+    block->prev = NULL;
+    block->next = info->free_lists[order];
+    if (block->next)
+        block->next->prev = block;
+
+    info->free_lists[order] = block;
+    info->n_free[order]++;
+    info->ordermap[index] = BF_FREE | order;
+}
+
+static void list_remove(u32 index, u32 order)
+{
+    struct buddy_block *block;
+    struct meminfo *info;
+
+    info = &__micron_meminfo;
+    block = block_at(index);
+
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        info->free_lists[order] = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+
+    info->n_free[order]--;
+    info->ordermap[index] = 0;
+}
+
+static u32 fitting_order(u32 index, u32 end)
+{
+    u32 order;
+
+    /* Largest block which is naturally aligned at index and ends before end. */
+
+    order = 0;
+    while (order + 1 < BUDDY_ORDERS && !(index & ((2u << order) - 1))
+           && index + (2u << order) <= end)
+        order++;
+
+    return order;
+}
+
+static void free_block(u32 index, u32 order)
+{
+    struct meminfo *info;
+    u32 buddy;
+
+    info = &__micron_meminfo;
+
+    /* Coalesce with the buddy for as long as it is free and of the same order,
+       so the free lists never hold two blocks which could be merged. */
+
+    while (order + 1 < BUDDY_ORDERS) {
+        buddy = index ^ (1u << order);
+        if (buddy + (1u << order) > info->n_pages)
+            break;
+        if (info->ordermap[buddy] != (BF_FREE | order))
+            break;
+
+        list_remove(buddy, order);
+        index &= ~(1u << order);
+        order++;
+    }
+
+    list_push(index, order);
+}
+
+static void free_range(u32 index, u32 end)
+{
+    u32 order;
+
+    while (index < end) {
+        order = fitting_order(index, end);
+        free_block(index, order);
+        index += 1u << order;
+    }
+}
+
+usize _page_core_metasize(u32 n_pages)
+{
+    /* ordermap */
+    return n_pages;
+}
+
+void _page_core_init(u8 *meta)
+{
+    struct meminfo *info;
+
+    info = &__micron_meminfo;
+    info->ordermap = meta;
+
+    for (u32 i = 0; i < info->n_pages; i++)
+        info->ordermap[i] = 0;
+    for (u32 i = 0; i < BUDDY_ORDERS; i++) {
+        info->free_lists[i] = NULL;
+        info->n_free[i] = 0;
+    }
+
+    /* The heap doesn't have to be a power of two, so split it into the largest
+       aligned blocks which fit. */
+
+    free_range(0, info->n_pages);
+}
+
+i32 _page_core_alloc(u32 pages)
+{
+    struct meminfo *info;
+    u32 order;
+    u32 index;
+    u32 block;
+    u32 want;
+    u32 end;
+
+    info = &__micron_meminfo;
+
+    want = 0;
+    while (want < BUDDY_ORDERS && (1u << want) < pages)
+        want++;
+
+    for (order = want; order < BUDDY_ORDERS; order++) {
+        if (info->free_lists[order])
+            break;
+    }
+
+    if (order >= BUDDY_ORDERS)
+        return -1;
+
+    index = block_index(info->free_lists[order]);
+    list_remove(index, order);
+
+    /* Split the block until it's the smallest one that fits the request,
+       returning the upper halves to the free lists. */
+
+    while (order > want) {
+        order--;
+        list_push(index + (1u << order), order);
+    }
+
+    /* A 150 page request would waste 106 pages of a 256 page block, so give
+       the unused tail back. The run is then made of the blocks from the binary
+       representation of the size, each marked in the ordermap. */
+
+    end = index + pages;
+    free_range(end, index + (1u << order));
+
+    block = index;
+    while (block < end) {
+        order = fitting_order(block, end);
+        info->ordermap[block] = BF_ALLOC | order;
+        block += 1u << order;
+        if (block >= end)
+            info->ordermap[block - (1u << order)] |= BF_LAST;
+    }
+
+    return index;
+}
+
+u32 _page_core_free(u32 index)
+{
+    struct meminfo *info;
+    u32 order;
+    u32 pages;
+    u8 flags;
+
+    info = &__micron_meminfo;
+    pages = 0;
+
+    do {
+        flags = info->ordermap[index];
+        order = flags & BF_ORDER;
+
+        info->ordermap[index] = 0;
+        free_block(index, order);
+
+        index += 1u << order;
+        pages += 1u << order;
+    } while (!(flags & BF_LAST));
+
+    return pages;
+}
+
+u32 _page_core_largest()
+{
+    struct meminfo *info;
+
+    /* Free blocks are always fully coalesced, so the biggest free run is the
+       highest non-empty order. */
+
+    info = &__micron_meminfo;
+    for (i32 i = BUDDY_ORDERS - 1; i >= 0; i--) {
+        if (info->n_free[i])
+            return 1u << i;
+    }
+
+    return 0;
+}
+
+void _page_core_info()
+{
+    struct meminfo *info;
+    u32 free_pages;
+
+    info = &__micron_meminfo;
+    free_pages = 0;
+
+    syslog("Buddy free lists:");
+
+    for (u32 i = 0; i < BUDDY_ORDERS; i++) {
+        free_pages += info->n_free[i] << i;
+        if (!info->n_free[i])
+            continue;
+        syslog("  order %2u (%5u kB): %u free", i,
+               (PAGE_SIZE << i) >> 10, info->n_free[i]);
+    }
+
+    syslog("Free pages: %u", free_pages);
+}
+
+#endif /* MICRON_CONFIG_MEM_BUDDY */
@@ -0,0 +1,129 @@
+/* mem/dma.c - DMA memory helpers
+   Copyright (c) 2025 bellrise */
+
+#include <micron/mem.h>
+#include <pico.h>
+#include <string.h>
+
+#if PICO_ON_DEVICE
+# include <hardware/dma.h>
+#endif
+
+/* Below this, setting up the channel costs more than the copy itself. */
+#define DMA_MIN_COPY 256
+
+#if PICO_ON_DEVICE
+/* The fill source has to stay put until the transfer is done, so each
+   channel gets its own pattern word. */
+static u32 fill_patterns[NUM_DMA_CHANNELS];
+#endif
+
+static void cpu_fill(void *addr, u32 pages, u32 pattern)
+{
+    u32 *word;
+    u32 *end;
+
+    if ((pattern & 0xFF) * 0x01010101 == pattern) {
+        memset(addr, pattern & 0xFF, pages << PAGE_SIZE_BITS);
+        return;
+    }
+
+    word = addr;
+    end = word + ((pages << PAGE_SIZE_BITS) >> 2);
+    while (word < end)
+        *word++ = pattern;
+}
+
+#if PICO_ON_DEVICE
+
+void mem_dma_copy(void *dest, const void *src, usize size)
+{
+    dma_channel_config conf;
+    i32 chan;
+
+    if (size < DMA_MIN_COPY || ((uptr) dest | (uptr) src | size) & 3)
+        goto cpu_copy;
+
+    chan = dma_claim_unused_channel(false);
+    if (chan < 0)
+        goto cpu_copy;
+
+    /* The channel reads ahead of the writes, so an ascending copy is safe
+       as long as the destination is below the source. */
+
+    conf = dma_channel_get_default_config(chan);
+    channel_config_set_transfer_data_size(&conf, DMA_SIZE_32);
+    channel_config_set_read_increment(&conf, true);
+    channel_config_set_write_increment(&conf, true);
+
+    dma_channel_configure(chan, &conf, dest, src, size >> 2, true);
+    dma_channel_wait_for_finish_blocking(chan);
+    dma_channel_unclaim(chan);
+
+    return;
+
+cpu_copy:
+    memmove(dest, src, size);
+}
+
+i32 page_fill_async(void *addr, u32 pages, u32 pattern)
+{
+    dma_channel_config conf;
+    i32 chan;
+
+    /* Reading the same word over and over, and writing it to consecutive
+       addresses, fills the pages without the CPU. */
+
+    chan = dma_claim_unused_channel(false);
+    if (chan < 0) {
+        cpu_fill(addr, pages, pattern);
+        return -1;
+    }
+
+    fill_patterns[chan] = pattern;
+
+    conf = dma_channel_get_default_config(chan);
+    channel_config_set_transfer_data_size(&conf, DMA_SIZE_32);
+    channel_config_set_read_increment(&conf, false);
+    channel_config_set_write_increment(&conf, true);
+
+    dma_channel_configure(chan, &conf, addr, &fill_patterns[chan],
+                          (pages << PAGE_SIZE_BITS) >> 2, true);
+
+    return chan;
+}
+
+void page_fill_wait(i32 fill)
+{
+    if (fill < 0)
+        return;
+
+    dma_channel_wait_for_finish_blocking(fill);
+    dma_channel_unclaim(fill);
+}
+
+#else
+
+/* Host builds have no DMA, the CPU does all of it. */
+
+void mem_dma_copy(void *dest, const void *src, usize size)
+{
+    memmove(dest, src, size);
+}
+
+i32 page_fill_async(void *addr, u32 pages, u32 pattern)
+{
+    cpu_fill(addr, pages, pattern);
+    return -1;
+}
+
+void page_fill_wait(i32 __unused fill)
+{
+}
+
+#endif /* PICO_ON_DEVICE */
+
+void page_fill(void *addr, u32 pages, u32 pattern)
+{
+    page_fill_wait(page_fill_async(addr, pages, pattern));
+}
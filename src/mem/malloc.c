@@ -0,0 +1,288 @@
+/* mem/malloc.c - general purpose allocator
+   Copyright (c) 2025 bellrise */
+
+#include <hardware/sync.h>
+#include <micron/buildconfig.h>
+#include <micron/mem.h>
+#include <string.h>
+
+/* Small objects come from one object cache per power-of-two size class.
+   Anything bigger gets its own run of PF_USER pages, with the size stored in
+   a header in front of the returned pointer. kmemalign allocations with an
+   alignment over 8 bytes always get a run, with the header moved up to just
+   below the first aligned address. kfree tells the two apart from the
+   pagemap: object cache pages are marked with PF_SLAB. The bytes handed
+   out are counted per core, as a block may be freed on the other core than
+   it was allocated on; only their sum means anything. */
+
+#define KMALLOC_CLASSES 6 /* 16, 32, 64, 128, 256, 512 */
+#define KMALLOC_HEADER  8 /* keeps large allocations 8-byte aligned */
+
+struct kmalloc_header
+{
+    u32 size;
+    u32 offset; /* from the start of the page run */
+};
+
+extern struct meminfo __micron_meminfo;
+
+static struct mem_cache *kmalloc_caches[KMALLOC_CLASSES];
+static iptr kmalloc_used[2];
+static usize kmalloc_high;
+static const char *kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16",  "kmalloc-32",  "kmalloc-64",
+    "kmalloc-128", "kmalloc-256", "kmalloc-512",
+};
+
+static inline u32 size_class(usize size)
+{
+    if (size <= KMALLOC_MIN)
+        return 0;
+    return 32 - __builtin_clz(size - 1) - 4;
+}
+
+static inline u8 page_flags(void *ptr)
+{
+    struct meminfo *info;
+    uptr offset;
+
+    /* Anything outside of the page heap was never ours, be it a pointer from
+       another allocator, or garbage. */
+
+    info = &__micron_meminfo;
+    offset = (uptr) ptr - (uptr) info->pages_start;
+
+    if ((uptr) ptr < (uptr) info->pages_start
+        || offset >= (uptr) info->n_pages << PAGE_SIZE_BITS)
+        panic("kmalloc: %p is not from the page heap", ptr);
+
+    return info->pagemap[offset >> PAGE_SIZE_BITS];
+}
+
+static inline struct kmalloc_header *header_of(void *ptr)
+{
+    return (struct kmalloc_header *) ((u8 *) ptr - KMALLOC_HEADER);
+}
+
+static void kmalloc_account(iptr bytes)
+{
+    usize used;
+    u32 irq;
+
+    irq = save_and_disable_interrupts();
+    kmalloc_used[get_core_num()] += bytes;
+    used = kmalloc_used[0] + kmalloc_used[1];
+    if (used > kmalloc_high)
+        kmalloc_high = used;
+    restore_interrupts(irq);
+}
+
+void _kmalloc_init()
+{
+    for (u32 i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] =
+            mem_cache_create(kmalloc_names[i], KMALLOC_MIN << i, 8);
+    }
+}
+
+static void *run_alloc(usize size, u32 offset)
+{
+    struct kmalloc_header *header;
+    u8 *run;
+    u32 pages;
+
+    pages = (offset + KMALLOC_HEADER + size + PAGE_SIZE - 1) >> PAGE_SIZE_BITS;
+    run = page_alloc(pages, PF_USER);
+    if (!run)
+        return NULL;
+
+    header = (struct kmalloc_header *) (run + offset);
+    header->size = size;
+    header->offset = offset;
+    kmalloc_account(size);
+
+    return run + offset + KMALLOC_HEADER;
+}
+
+void *kmalloc(usize size)
+{
+    struct mem_cache *cache;
+    void *ptr;
+
+    if (!__micron_meminfo.n_pages)
+        _mem_init();
+
+    if (size <= KMALLOC_MAX) {
+        cache = kmalloc_caches[size_class(size)];
+        if ((ptr = mem_cache_alloc(cache)))
+            kmalloc_account(cache->size);
+        return ptr;
+    }
+
+    return run_alloc(size, 0);
+}
+
+void *kmemalign(usize align, usize size)
+{
+    if (!align || align & (align - 1) || align > PAGE_SIZE)
+        return NULL;
+    if (align <= KMALLOC_HEADER)
+        return kmalloc(size);
+
+    if (!__micron_meminfo.n_pages)
+        _mem_init();
+
+    return run_alloc(size, align - KMALLOC_HEADER);
+}
+
+void *kcalloc(usize n, usize size)
+{
+    usize total;
+    void *ptr;
+
+    if (__builtin_mul_overflow(n, size, &total))
+        return NULL;
+
+    ptr = kmalloc(total);
+    if (ptr)
+        memset(ptr, 0, total);
+
+    return ptr;
+}
+
+usize ksize(void *ptr)
+{
+    if (page_flags(ptr) & PF_SLAB)
+        return mem_cache_of(ptr)->size;
+    return header_of(ptr)->size;
+}
+
+void *krealloc(void *ptr, usize size)
+{
+    void *new_ptr;
+    usize old_size;
+
+    if (!ptr)
+        return kmalloc(size);
+
+    if (!size) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    /* Stay in place if the new size still fits, unless it would leave most of
+       a size class object unused. */
+
+    old_size = ksize(ptr);
+    if (size <= old_size && (old_size <= KMALLOC_MAX || size > KMALLOC_MAX)
+        && size > old_size / 2)
+        return ptr;
+
+    new_ptr = kmalloc(size);
+    if (!new_ptr)
+        return NULL;
+
+    memcpy(new_ptr, ptr, imin(old_size, size));
+    kfree(ptr);
+
+    return new_ptr;
+}
+
+void kfree(void *ptr)
+{
+    struct kmalloc_header *header;
+
+    if (!ptr)
+        return;
+
+    kmalloc_account(-(iptr) ksize(ptr));
+
+    if (page_flags(ptr) & PF_SLAB) {
+        mem_cache_free(mem_cache_of(ptr), ptr);
+        return;
+    }
+
+    header = header_of(ptr);
+    if (page_free((u8 *) header - header->offset))
+        panic("kfree: %p was not returned by kmalloc", ptr);
+}
+
+usize kmalloc_high_water()
+{
+    return kmalloc_high;
+}
+
+#if MICRON_CONFIG_MEM_MALLOC
+
+/* newlib calls the reentrant versions internally, so both have to be
+   replaced, otherwise its own malloc would get linked in. Nothing has to
+   run before the first call, kmalloc sets up the page heap itself. */
+
+struct _reent;
+
+void *malloc(size_t size)
+{
+    return kmalloc(size);
+}
+
+void free(void *ptr)
+{
+    kfree(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    return krealloc(ptr, size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    return kcalloc(n, size);
+}
+
+void *_malloc_r(struct _reent *r __unused, size_t size)
+{
+    return kmalloc(size);
+}
+
+void _free_r(struct _reent *r __unused, void *ptr)
+{
+    kfree(ptr);
+}
+
+void *_realloc_r(struct _reent *r __unused, void *ptr, size_t size)
+{
+    return krealloc(ptr, size);
+}
+
+void *_calloc_r(struct _reent *r __unused, size_t n, size_t size)
+{
+    return kcalloc(n, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return kmemalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return kmemalign(align, size);
+}
+
+void *_memalign_r(struct _reent *r __unused, size_t align, size_t size)
+{
+    return kmemalign(align, size);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return ptr ? ksize(ptr) : 0;
+}
+
+size_t _malloc_usable_size_r(struct _reent *r __unused, void *ptr)
+{
+    return ptr ? ksize(ptr) : 0;
+}
+
+#endif /* MICRON_CONFIG_MEM_MALLOC */
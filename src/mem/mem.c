@@ -0,0 +1,534 @@
+/* mem/mem.c - memory control
+   Copyright (c) 2024 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/errno.h>
+#include <micron/mem.h>
+#include <hardware/sync.h>
+#include <micron/syslog.h>
+#include <pico/printf.h>
+#include <string.h>
+
+/* Per-core cache of single free pages. The pages are allocated from the core
+   point of view, and marked with PF_CACHE in the pagemap. */
+
+struct page_mag
+{
+    u32 n;
+    u8 *pages[MICRON_CONFIG_MEM_MAGAZINE + 1]; /* +1 so 0 still compiles */
+};
+
+struct mem_counters
+{
+    u32 allocs;
+    u32 frees;
+    u32 failures;
+};
+
+struct meminfo __micron_meminfo;
+static struct page_mag page_mags[2];
+static struct mem_counters mem_counters[2];
+static spin_lock_t *mem_lock;
+
+#if MICRON_CONFIG_MEM_TRACE
+# define mem_trace(type, addr, pages)                                          \
+     _mem_trace(type, addr, pages, __builtin_return_address(0))
+#else
+# define mem_trace(type, addr, pages)
+#endif
+
+extern void *_sbrk(i32 incr);
+
+#if PICO_ON_DEVICE
+extern u8 __StackLimit;
+extern u8 __bss_end__;
+#else
+/* Host builds have no linker script, see host/ram.c. */
+# include <micron/host.h>
+# define __StackLimit host_ram[HOST_RAM_SIZE]
+# define __bss_end__  host_ram[0]
+#endif
+
+i32 _mem_init()
+{
+    struct meminfo *info;
+    u32 total_pages;
+    u32 free_pages;
+    u32 meta_pages;
+    usize meta_size;
+    uptr ptr;
+
+    /* Allocate some memory for the system. First, we need to align the SBRK to
+       the closest page size. */
+
+    info = &__micron_meminfo;
+
+    /* With MICRON_CONFIG_MEM_MALLOC, the first malloc call may come before
+       main() and initialize the heap on its own. */
+
+    if (info->n_pages)
+        return 0;
+
+    ptr = (uptr) _sbrk(0);
+    if (ptr & PAGE_SIZE_MASK) {
+        _sbrk(PAGE_SIZE - (ptr & PAGE_SIZE_MASK));
+    }
+
+    /* When we replace malloc, nothing else is going to use _sbrk, so the page
+       heap can take everything up to the stack. */
+
+#if MICRON_CONFIG_MEM_MALLOC
+    info->heap_size =
+        ((uptr) &__StackLimit - (uptr) _sbrk(0)) & ~PAGE_SIZE_MASK;
+#else
+    info->heap_size = MICRON_CONFIG_MEM_HEAP * 1024;
+#endif
+    info->heap_start = _sbrk(info->heap_size);
+    info->heap_end = _sbrk(0);
+
+    /* Reserve enough bytes to store the whole page map (1B per page) along
+       with the allocator core metadata, and an additional page for padding.
+       The rest is usable. */
+
+    total_pages = info->heap_size >> PAGE_SIZE_BITS;
+    meta_size = ((total_pages + 3) & ~3) + _page_core_metasize(total_pages);
+    meta_pages = (meta_size >> PAGE_SIZE_BITS) + 2;
+    free_pages = total_pages - meta_pages;
+
+    info->pagemap = info->heap_start;
+    info->n_pages = free_pages;
+    info->pages_start = info->heap_start + (meta_pages << PAGE_SIZE_BITS);
+
+    memset(info->heap_start, 0, info->n_pages);
+    _page_core_init(info->pagemap + ((info->n_pages + 3) & ~3));
+
+    /* Both cores may allocate pages, so the page heap is protected by its own
+       hardware spinlock. */
+
+    mem_lock = spin_lock_init(spin_lock_claim_unused(true));
+    _mem_cache_init();
+    _kmalloc_init();
+
+    return 0;
+}
+
+static void dump_pagemap()
+{
+    struct meminfo *info;
+    u32 left_to_show;
+    u32 to_show;
+    uptr index;
+    uptr offset;
+    const char *m;
+
+    info = &__micron_meminfo;
+    offset = (uptr) info->pages_start;
+    index = 0;
+    left_to_show = info->n_pages;
+
+    syslog("Page map (line is %zu kB), %u+%u pages:",
+           (32 * PAGE_SIZE) >> PAGE_SIZE_BITS, info->n_pages,
+           (u32) (info->heap_size >> PAGE_SIZE_BITS) - info->n_pages);
+
+    while (left_to_show > 0) {
+        syslog_impl(__FILE__, "", "  %08p  ", offset);
+        to_show = imin(left_to_show, 32);
+
+        for (u32 i = 0; i < to_show; i++) {
+            m = "m-";
+            if (info->pagemap[index + i] & PF_ALLOC)
+                m = "33mA";
+            if (info->pagemap[index + i] & PF_USER)
+                m = "34mU";
+            if (info->pagemap[index + i] & PF_SLAB)
+                m = "35mS";
+            if (info->pagemap[index + i] & PF_CACHE)
+                m = "36mC";
+            if (info->pagemap[index + i] & PF_MOVABLE)
+                m = "32mM";
+            printf("\033[%s%s\033[m",
+                   info->pagemap[index + i] & PF_START ? "1;" : "", m);
+        }
+
+        index += to_show;
+        offset += PAGE_SIZE * to_show;
+        left_to_show -= to_show;
+
+        printf("\n");
+    }
+}
+
+static void print_range(void *a, void *b, const char *name)
+{
+    syslog("  %08p - %08p % 8.2f kB %s", (uptr) a, (uptr) b,
+           (float) (b - a) / 1024, name);
+}
+
+void mem_info()
+{
+    struct meminfo *info;
+    struct memstat stat;
+
+    info = &__micron_meminfo;
+
+    syslog("System heap %zu kB", info->heap_size >> 10, info->heap_start,
+           info->heap_end);
+    syslog("Malloc heap %zu kB",
+           ((uptr) &__StackLimit - (uptr) &__bss_end__ - info->heap_size)
+               >> 10);
+
+    syslog("Memory map:");
+    print_range(info->pagemap, info->heap_start + info->n_pages,
+                "\033[33mpagemap");
+    print_range(info->heap_start + info->n_pages + 1, info->pages_start - 1,
+                "\033[31mreserved");
+    print_range(info->pages_start,
+                info->pages_start + (info->n_pages << PAGE_SIZE_BITS) - 1,
+                "\033[1;32musable");
+    print_range(info->heap_end, &__StackLimit, "malloc-heap");
+    dump_pagemap();
+    _page_core_info();
+
+    mem_stat(&stat);
+    syslog("Used pages: %u/%u, high water: %u, fragmentation: %u.%u%%",
+           stat.pages_used, stat.pages_total, stat.pages_high_water,
+           stat.frag_permille / 10, stat.frag_permille % 10);
+    mem_cache_info();
+}
+
+i32 _mem_close()
+{
+    return 0;
+}
+
+#if MICRON_CONFIG_MEM_MALLOC
+
+usize malloc_heap_free_left()
+{
+    struct meminfo *info;
+
+    /* malloc is served by kmalloc, so it all comes from the page heap, and
+       kmalloc keeps track of its own high water. */
+
+    info = &__micron_meminfo;
+    return (usize) (info->n_pages - info->used_pages) << PAGE_SIZE_BITS;
+}
+
+static usize malloc_high_water_get()
+{
+    return kmalloc_high_water();
+}
+
+#else
+
+static volatile usize malloc_high_water;
+
+# if PICO_ON_DEVICE
+
+extern void *__real__sbrk(i32 incr);
+
+/* Projects are linked with --wrap=_sbrk (see dist/cmake.template), so every
+   time newlib grows the malloc heap it comes through here, and the high
+   water can't miss a peak which was freed again before anyone looked. The
+   page heap is taken in _mem_init before heap_end is set, so it doesn't
+   count. */
+
+void *__wrap__sbrk(i32 incr)
+{
+    usize used;
+    void *prev;
+
+    prev = __real__sbrk(incr);
+    if (prev == (void *) -1 || !__micron_meminfo.heap_end)
+        return prev;
+
+    used = (uptr) prev + incr - (uptr) __micron_meminfo.heap_end;
+    if (used > malloc_high_water)
+        malloc_high_water = used;
+
+    return prev;
+}
+
+# endif
+
+usize malloc_heap_free_left()
+{
+    return (usize) &__StackLimit - (uptr) _sbrk(0);
+}
+
+static usize malloc_high_water_get()
+{
+    return malloc_high_water;
+}
+
+#endif
+
+void mem_stat(struct memstat *stat)
+{
+    struct meminfo *info;
+    u32 free_pages;
+    u32 irq;
+
+    info = &__micron_meminfo;
+
+    irq = _mem_lock();
+    stat->pages_total = info->n_pages;
+    stat->pages_used = info->used_pages;
+    stat->pages_high_water = info->used_high;
+    stat->largest_free_run = _page_core_largest();
+    _mem_unlock(irq);
+
+    /* Fragmentation is the part of free memory which cannot be handed out in
+       a single allocation: 0 for one big free run, close to 1000 when the
+       free pages are scattered all over the heap. */
+
+    free_pages = stat->pages_total - stat->pages_used;
+    stat->frag_permille =
+        free_pages ? 1000 - stat->largest_free_run * 1000 / free_pages : 0;
+
+    stat->allocs = mem_counters[0].allocs + mem_counters[1].allocs;
+    stat->frees = mem_counters[0].frees + mem_counters[1].frees;
+    stat->failures = mem_counters[0].failures + mem_counters[1].failures;
+
+    stat->malloc_free = malloc_heap_free_left();
+    stat->malloc_high_water = malloc_high_water_get();
+
+    stack_report();
+}
+
+u32 _mem_lock()
+{
+    return spin_lock_blocking(mem_lock);
+}
+
+void _mem_unlock(u32 irq)
+{
+    spin_unlock(mem_lock, irq);
+}
+
+i32 _mem_core_alloc(u32 pages, u8 flags)
+{
+    struct meminfo *info;
+    i32 index;
+
+    /* Called with the mem lock held. */
+
+    info = &__micron_meminfo;
+    index = _page_core_alloc(pages);
+    if (index < 0)
+        return index;
+
+    info->pagemap[index] = flags | PF_ALLOC | PF_START;
+    memset(&info->pagemap[index + 1], flags | PF_ALLOC, pages - 1);
+
+    info->used_pages += pages;
+    if (info->used_pages > info->used_high)
+        info->used_high = info->used_pages;
+
+    return index;
+}
+
+void _mem_core_free(u32 index)
+{
+    u32 pages;
+
+    /* Called with the mem lock held. The pagemap has to be cleared before
+       the lock is dropped, otherwise the other core could allocate the pages
+       and have its flags overwritten. */
+
+    pages = _page_core_free(index);
+    memset(&__micron_meminfo.pagemap[index], 0, pages);
+    __micron_meminfo.used_pages -= pages;
+}
+
+static u32 page_index(void *addr)
+{
+    return ((uptr) addr - (uptr) __micron_meminfo.pages_start)
+        >> PAGE_SIZE_BITS;
+}
+
+static void mag_flush(struct page_mag *mag, u32 keep)
+{
+    u32 irq;
+
+    irq = _mem_lock();
+    while (mag->n > keep)
+        _mem_core_free(page_index(mag->pages[--mag->n]));
+    _mem_unlock(irq);
+}
+
+static void *mag_alloc(u8 flags)
+{
+    struct page_mag *mag;
+    u32 irq;
+    i32 index;
+    u8 *page;
+
+    /* Single pages are served from a small per-core magazine. Only this core
+       ever touches its magazine, so we just have to keep interrupts away.
+       When it runs empty, refill half of it under the mem lock, but at least
+       one page, or a magazine of 1 would never get any. */
+
+    irq = save_and_disable_interrupts();
+    mag = &page_mags[get_core_num()];
+
+    if (!mag->n) {
+        spin_lock_unsafe_blocking(mem_lock);
+        while ((i32) mag->n < imax(1, MICRON_CONFIG_MEM_MAGAZINE / 2)) {
+            if ((index = _mem_core_alloc(1, PF_CACHE)) < 0)
+                break;
+            mag->pages[mag->n++] = __micron_meminfo.pages_start
+                                 + (index << PAGE_SIZE_BITS);
+        }
+        spin_unlock_unsafe(mem_lock);
+    }
+
+    page = mag->n ? mag->pages[--mag->n] : NULL;
+    if (page) {
+        __micron_meminfo.pagemap[page_index(page)] =
+            flags | PF_ALLOC | PF_START;
+        mem_counters[get_core_num()].allocs++;
+    } else {
+        mem_counters[get_core_num()].failures++;
+    }
+
+    restore_interrupts(irq);
+
+    return page;
+}
+
+static void mag_free(void *addr)
+{
+    struct page_mag *mag;
+    u32 irq;
+
+    irq = save_and_disable_interrupts();
+    mag = &page_mags[get_core_num()];
+
+    if (mag->n == MICRON_CONFIG_MEM_MAGAZINE) {
+        spin_lock_unsafe_blocking(mem_lock);
+        while (mag->n > MICRON_CONFIG_MEM_MAGAZINE / 2)
+            _mem_core_free(page_index(mag->pages[--mag->n]));
+        spin_unlock_unsafe(mem_lock);
+    }
+
+    __micron_meminfo.pagemap[page_index(addr)] =
+        PF_CACHE | PF_ALLOC | PF_START;
+    mag->pages[mag->n++] = addr;
+    mem_counters[get_core_num()].frees++;
+
+    restore_interrupts(irq);
+}
+
+static void *run_alloc(u32 pages, u8 flags)
+{
+    i32 index;
+    u32 irq;
+
+    irq = _mem_lock();
+    index = _mem_core_alloc(pages, flags);
+
+    /* Our own magazine may be holding the pages we need. */
+
+    if (index < 0 && MICRON_CONFIG_MEM_MAGAZINE) {
+        _mem_unlock(irq);
+        mag_flush(&page_mags[get_core_num()], 0);
+        irq = _mem_lock();
+        index = _mem_core_alloc(pages, flags);
+    }
+
+    /* Last resort, slide the movable runs together and try once more. Never
+       on core 1, so the network thread doesn't stall on the copies. */
+
+    if (index < 0 && MICRON_CONFIG_MEM_COMPACT && MICRON_CONFIG_MEM_HANDLES
+        && !get_core_num()) {
+        _mem_unlock(irq);
+        mem_compact();
+        irq = _mem_lock();
+        index = _mem_core_alloc(pages, flags);
+    }
+
+    if (index < 0)
+        mem_counters[get_core_num()].failures++;
+    else
+        mem_counters[get_core_num()].allocs++;
+
+    _mem_unlock(irq);
+
+    if (index < 0)
+        return NULL;
+
+    return __micron_meminfo.pages_start + (index << PAGE_SIZE_BITS);
+}
+
+void *page_alloc(u32 pages, u8 flags)
+{
+    void *page;
+
+    /* page_alloc always returns a contiguous array of memory on success. The
+       search itself is done by the allocator core (see mem/page.c), here we
+       only mark the pages in the pagemap. The first page is written before
+       the rest, so it never looks like the continuation of another run. */
+
+    if (!pages)
+        return NULL;
+
+    if (pages == 1 && MICRON_CONFIG_MEM_MAGAZINE)
+        page = mag_alloc(flags & ~PF_ZERO);
+    else
+        page = run_alloc(pages, flags & ~PF_ZERO);
+
+    mem_trace(page ? MT_ALLOC : MT_FAIL, page, pages);
+
+    if (page && flags & PF_ZERO)
+        page_fill(page, pages, 0);
+
+    return page;
+}
+
+i32 page_free(void *addr)
+{
+    struct meminfo *info;
+    uptr index;
+    uptr offset;
+    u32 pages;
+    u32 irq;
+    u8 next;
+
+    info = &__micron_meminfo;
+
+    if ((uptr) addr < (uptr) info->pages_start)
+        panic("invalid pointer, addr out of range");
+
+    offset = (uptr) addr - (uptr) info->pages_start;
+    index = offset >> PAGE_SIZE_BITS;
+
+    if (index >= info->n_pages)
+        panic("invalid pointer, addr out of range");
+    if (offset & PAGE_SIZE_MASK || !(info->pagemap[index] & PF_START))
+        return EINVAL;
+    if (info->pagemap[index] & (PF_CACHE | PF_MOVABLE))
+        return EINVAL;
+
+    /* A single page run goes back into the magazine. We can tell it's a single
+       page without the lock: the next page is either free, or the start of a
+       run, as nobody else can make it a continuation of ours. */
+
+    next = index + 1 < info->n_pages ? info->pagemap[index + 1] : 0;
+    if (MICRON_CONFIG_MEM_MAGAZINE && (!(next & PF_ALLOC) || next & PF_START)) {
+        mag_free(addr);
+        mem_trace(MT_FREE, addr, 1);
+        return 0;
+    }
+
+    irq = _mem_lock();
+    pages = info->used_pages;
+    _mem_core_free(index);
+    pages -= info->used_pages;
+    mem_counters[get_core_num()].frees++;
+    _mem_unlock(irq);
+
+    mem_trace(MT_FREE, addr, pages);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+/* mem/movable.c - movable page runs & heap compaction
+   Copyright (c) 2025 bellrise */
+
+#include <hardware/sync.h>
+#include <micron/buildconfig.h>
+#include <micron/errno.h>
+#include <micron/mem.h>
+
+/* Every movable run is referenced by exactly one handle, so moving it only
+   means updating handle->addr. The handles live in a small static table, and
+   all of their fields are protected by the mem lock. The runs themselves are
+   marked with PF_MOVABLE, so a plain page_free refuses them. */
+
+extern struct meminfo __micron_meminfo;
+
+static struct page_handle handles[MICRON_CONFIG_MEM_HANDLES + 1];
+
+static inline u32 run_index(void *addr)
+{
+    return ((uptr) addr - (uptr) __micron_meminfo.pages_start)
+        >> PAGE_SIZE_BITS;
+}
+
+static void run_release(void *addr)
+{
+    u32 irq;
+
+    irq = _mem_lock();
+    __micron_meminfo.pagemap[run_index(addr)] &= ~PF_MOVABLE;
+    _mem_unlock(irq);
+
+    page_free(addr);
+}
+
+struct page_handle *page_alloc_movable(u32 pages, u8 flags)
+{
+    struct page_handle *handle;
+    void *addr;
+    u32 irq;
+
+    addr = page_alloc(pages, flags | PF_MOVABLE);
+    if (!addr)
+        return NULL;
+
+    handle = NULL;
+    irq = _mem_lock();
+
+    for (u32 i = 0; i < MICRON_CONFIG_MEM_HANDLES; i++) {
+        if (!handles[i].addr) {
+            handle = &handles[i];
+            handle->addr = addr;
+            handle->pages = pages;
+            handle->pins = 0;
+            break;
+        }
+    }
+
+    _mem_unlock(irq);
+
+    if (!handle)
+        run_release(addr);
+
+    return handle;
+}
+
+i32 page_free_movable(struct page_handle *handle)
+{
+    void *addr;
+    u32 irq;
+
+    irq = _mem_lock();
+
+    if (!handle->addr || handle->pins) {
+        _mem_unlock(irq);
+        return EINVAL;
+    }
+
+    addr = handle->addr;
+    handle->addr = NULL;
+    _mem_unlock(irq);
+
+    run_release(addr);
+    return 0;
+}
+
+void *page_pin(struct page_handle *handle)
+{
+    void *addr;
+    u32 irq;
+
+    irq = _mem_lock();
+    handle->pins++;
+    addr = handle->addr;
+    _mem_unlock(irq);
+
+    return addr;
+}
+
+void page_unpin(struct page_handle *handle)
+{
+    u32 irq;
+
+    irq = _mem_lock();
+    if (!handle->pins)
+        panic("page_unpin: handle %p is not pinned", handle);
+    handle->pins--;
+    _mem_unlock(irq);
+}
+
+#if MICRON_CONFIG_MEM_BUDDY
+
+u32 mem_compact()
+{
+    return 0;
+}
+
+#else
+
+static struct page_handle *next_handle(u8 *after)
+{
+    struct page_handle *next;
+
+    /* Lowest handle above the given address. */
+
+    next = NULL;
+    for (u32 i = 0; i < MICRON_CONFIG_MEM_HANDLES; i++) {
+        if (handles[i].addr <= after)
+            continue;
+        if (!next || handles[i].addr < next->addr)
+            next = &handles[i];
+    }
+
+    return next;
+}
+
+static u32 move_down(struct page_handle *handle)
+{
+    struct meminfo *info;
+    u32 index;
+    i32 dest;
+    u8 flags;
+
+    /* Give the run back to the core and allocate it again. With first-fit,
+       the new run is never above the old one, as the old one is free at this
+       point. Both may overlap, which is fine when copying downwards. */
+
+    info = &__micron_meminfo;
+    index = run_index(handle->addr);
+    flags = info->pagemap[index] & ~(PF_ALLOC | PF_START);
+
+    _mem_core_free(index);
+    dest = _mem_core_alloc(handle->pages, flags);
+
+    if (dest < 0)
+        panic("mem_compact: lost a run of %u pages", handle->pages);
+    if ((u32) dest == index)
+        return 0;
+
+    mem_dma_copy(info->pages_start + (dest << PAGE_SIZE_BITS), handle->addr,
+                 handle->pages << PAGE_SIZE_BITS);
+
+    handle->addr = info->pages_start + (dest << PAGE_SIZE_BITS);
+    return handle->pages;
+}
+
+u32 mem_compact()
+{
+    struct page_handle *handle;
+    u32 moved;
+    u32 irq;
+    u8 *last;
+
+    moved = 0;
+    last = NULL;
+
+    /* Go through the runs from the lowest address up, so each one can slide
+       into the space left behind by the previous ones. The lock is dropped
+       between runs, so the other core only waits for a single copy. */
+
+    while (1) {
+        irq = _mem_lock();
+
+        handle = next_handle(last);
+        if (!handle) {
+            _mem_unlock(irq);
+            break;
+        }
+
+        last = handle->addr;
+        if (!handle->pins)
+            moved += move_down(handle);
+
+        _mem_unlock(irq);
+    }
+
+    return moved;
+}
+
+#endif /* MICRON_CONFIG_MEM_BUDDY */
@@ -0,0 +1,267 @@
+/* mem/page.c - bitmap page allocator core
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/mem.h>
+#include <micron/syslog.h>
+
+#if !MICRON_CONFIG_MEM_BUDDY
+
+#define WORD_BITS 32
+#define WORD_FULL 0xFFFFFFFF
+
+extern struct meminfo __micron_meminfo;
+
+/* The free map holds a single bit for each page, set if the page is free. This
+   way we can look at 32 pages at once, and use CTZ/CLZ to find the edges of
+   free runs. The start map marks the first page of each allocated run, so we
+   can find where a run ends without walking it page-by-page. On top of that,
+   the run map stores the longest free run inside each word, which lets the
+   search skip words that cannot fit the request. */
+
+static inline u32 head_run(u32 word)
+{
+    /* Free pages at the bottom of the word. */
+    return word == WORD_FULL ? WORD_BITS : (u32) __builtin_ctz(~word);
+}
+
+static inline u32 tail_run(u32 word)
+{
+    /* Free pages at the top of the word. */
+    return word == WORD_FULL ? WORD_BITS : (u32) __builtin_clz(~word);
+}
+
+static u8 longest_run(u32 word)
+{
+    u32 best;
+    u32 len;
+
+    best = 0;
+
+    while (word) {
+        word >>= __builtin_ctz(word);
+        len = head_run(word);
+        if (len > best)
+            best = len;
+        if (len == WORD_BITS)
+            break;
+        word >>= len;
+    }
+
+    return best;
+}
+
+static i32 find_in_word(u32 word, u32 size)
+{
+    u32 shift;
+
+    /* After each step, bit N is set only if there is a free run of `have`
+       pages starting at page N. Doubling the run length each time means we
+       need at most 5 steps for any size. */
+
+    for (u32 have = 1; have < size; have += shift) {
+        shift = imin(have, size - have);
+        word &= word >> shift;
+    }
+
+    return word ? __builtin_ctz(word) : -1;
+}
+
+static void update_runmap(u32 first_word, u32 last_word)
+{
+    struct meminfo *info;
+
+    info = &__micron_meminfo;
+    for (u32 w = first_word; w <= last_word; w++)
+        info->runmap[w] = longest_run(info->freemap[w]);
+}
+
+static void set_bits(u32 *map, u32 start, u32 size, bool value)
+{
+    u32 bit;
+    u32 len;
+    u32 mask;
+    u32 w;
+
+    while (size) {
+        w = start / WORD_BITS;
+        bit = start % WORD_BITS;
+        len = imin(WORD_BITS - bit, size);
+        mask = len == WORD_BITS ? WORD_FULL : ((1u << len) - 1) << bit;
+
+        if (value)
+            map[w] |= mask;
+        else
+            map[w] &= ~mask;
+
+        start += len;
+        size -= len;
+    }
+}
+
+usize _page_core_metasize(u32 n_pages)
+{
+    u32 n_words;
+
+    /* freemap + startmap + runmap */
+
+    n_words = (n_pages + WORD_BITS - 1) / WORD_BITS;
+    return n_words * (2 * sizeof(u32) + sizeof(u8));
+}
+
+void _page_core_init(u8 *meta)
+{
+    struct meminfo *info;
+
+    info = &__micron_meminfo;
+    info->n_words = (info->n_pages + WORD_BITS - 1) / WORD_BITS;
+    info->freemap = (u32 *) meta;
+    info->startmap = info->freemap + info->n_words;
+    info->runmap = (u8 *) (info->startmap + info->n_words);
+    info->free_hint = 0;
+
+    /* Bits past the last page stay cleared, so they are never seen as free
+       and always end a run. */
+
+    for (u32 w = 0; w < info->n_words; w++) {
+        info->freemap[w] = 0;
+        info->startmap[w] = 0;
+    }
+
+    set_bits(info->freemap, 0, info->n_pages, true);
+    update_runmap(0, info->n_words - 1);
+}
+
+i32 _page_core_alloc(u32 pages)
+{
+    struct meminfo *info;
+    u32 run_start;
+    u32 run_len;
+    u32 word;
+    u32 head;
+    u32 w;
+
+    info = &__micron_meminfo;
+    run_start = 0;
+    run_len = 0;
+
+    /* This is still first-fit, but instead of checking every page offset we
+       walk the free map a word at a time, carrying the free run which reaches
+       the top of the previous word. A run either ends in the bottom pages of
+       the current word, fits entirely inside it, or starts at its top. */
+
+    for (w = info->free_hint; w < info->n_words; w++) {
+        word = info->freemap[w];
+
+        if (word == WORD_FULL) {
+            if (!run_len)
+                run_start = w * WORD_BITS;
+            run_len += WORD_BITS;
+            if (run_len >= pages)
+                goto found;
+            continue;
+        }
+
+        head = head_run(word);
+        if (run_len && run_len + head >= pages)
+            goto found;
+
+        if (pages <= info->runmap[w]) {
+            run_start = w * WORD_BITS + find_in_word(word, pages);
+            goto found;
+        }
+
+        run_len = tail_run(word);
+        run_start = (w + 1) * WORD_BITS - run_len;
+    }
+
+    return -1;
+
+found:
+    set_bits(info->freemap, run_start, pages, false);
+    set_bits(info->startmap, run_start, 1, true);
+    update_runmap(run_start / WORD_BITS,
+                  (run_start + pages - 1) / WORD_BITS);
+
+    while (info->free_hint < info->n_words && !info->freemap[info->free_hint])
+        info->free_hint++;
+
+    return run_start;
+}
+
+u32 _page_core_free(u32 index)
+{
+    struct meminfo *info;
+    u32 stop;
+    u32 mask;
+    u32 end;
+    u32 w;
+
+    info = &__micron_meminfo;
+
+    /* The run ends at the first page which is either free or the start of
+       another run. */
+
+    end = info->n_pages;
+    w = (index + 1) / WORD_BITS;
+    mask = WORD_FULL << ((index + 1) % WORD_BITS);
+
+    for (; w < info->n_words; w++, mask = WORD_FULL) {
+        stop = (info->startmap[w] | info->freemap[w]) & mask;
+        if (stop) {
+            end = imin(w * WORD_BITS + __builtin_ctz(stop), info->n_pages);
+            break;
+        }
+    }
+
+    set_bits(info->startmap, index, 1, false);
+    set_bits(info->freemap, index, end - index, true);
+    update_runmap(index / WORD_BITS, (end - 1) / WORD_BITS);
+
+    if (index / WORD_BITS < info->free_hint)
+        info->free_hint = index / WORD_BITS;
+
+    return end - index;
+}
+
+u32 _page_core_largest()
+{
+    struct meminfo *info;
+    u32 largest;
+    u32 run_len;
+    u32 word;
+
+    info = &__micron_meminfo;
+    largest = 0;
+    run_len = 0;
+
+    /* Runs inside a word come from the run map, we only have to join the
+       ones crossing word boundaries. */
+
+    for (u32 w = 0; w < info->n_words; w++) {
+        word = info->freemap[w];
+        run_len += head_run(word);
+        largest = imax(largest, imax(run_len, info->runmap[w]));
+        if (word != WORD_FULL)
+            run_len = tail_run(word);
+    }
+
+    return largest;
+}
+
+void _page_core_info()
+{
+    struct meminfo *info;
+    u32 free_pages;
+
+    info = &__micron_meminfo;
+    free_pages = 0;
+
+    for (u32 w = 0; w < info->n_words; w++)
+        free_pages += __builtin_popcount(info->freemap[w]);
+
+    syslog("Free pages: %u, largest free run: %u pages", free_pages,
+           _page_core_largest());
+}
+
+#endif /* !MICRON_CONFIG_MEM_BUDDY */
@@ -0,0 +1,289 @@
+/* mem/slab.c - object caches
+   Copyright (c) 2025 bellrise */
+
+#include <hardware/sync.h>
+#include <micron/errno.h>
+#include <micron/mem.h>
+#include <micron/syslog.h>
+#include <pico/printf.h>
+
+/* Each slab is a contiguous run of pages, starting with a struct mem_slab
+   header followed by the objects. Free objects are chained through their
+   first word. A cache keeps its slabs on two lists: partial (at least one
+   free object) and full. One empty slab is kept around, so a cache which
+   keeps allocating & freeing a single object never touches page_alloc.
+   Every cache has its own striped spinlock, so both cores can use it. The
+   striped locks are shared with the SDK queues, so the page heap is never
+   called with one held: new slabs are made outside of the lock and linked
+   in afterwards, and empty ones are unlinked first and freed after. */
+
+#define SLAB_MIN_OBJECTS 4
+#define SLAB_MAX_PAGES   8
+
+struct mem_slab
+{
+    struct mem_cache *cache;
+    struct mem_slab *next;
+    struct mem_slab *prev;
+    void *freelist;
+    u16 inuse;
+};
+
+extern struct meminfo __micron_meminfo;
+
+static struct mem_cache cache_cache;
+static struct mem_cache *caches;
+
+static inline usize align_up(usize value, usize align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+static void slab_unlink(struct mem_slab **list, struct mem_slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static void slab_link(struct mem_slab **list, struct mem_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (slab->next)
+        slab->next->prev = slab;
+    *list = slab;
+}
+
+static struct mem_slab *slab_of(void *obj)
+{
+    struct meminfo *info;
+    uptr index;
+
+    /* Walk back to the first page of the slab run. This is at most
+       slab_pages - 1 steps, and zero for single-page slabs. */
+
+    info = &__micron_meminfo;
+    index = ((uptr) obj - (uptr) info->pages_start) >> PAGE_SIZE_BITS;
+
+    while (!(info->pagemap[index] & PF_START))
+        index--;
+
+    return (struct mem_slab *) (info->pages_start + (index << PAGE_SIZE_BITS));
+}
+
+static struct mem_slab *slab_create(struct mem_cache *cache)
+{
+    struct mem_slab *slab;
+    u8 *obj;
+
+    slab = page_alloc(cache->slab_pages, PF_SLAB);
+    if (!slab)
+        return NULL;
+
+    slab->cache = cache;
+    slab->freelist = NULL;
+    slab->inuse = 0;
+
+    /* Chain the objects in reverse, so the first allocation returns the
+       lowest address. */
+
+    obj = (u8 *) slab + cache->offset + (cache->per_slab - 1) * cache->size;
+    for (u32 i = 0; i < cache->per_slab; i++, obj -= cache->size) {
+        *(void **) obj = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    return slab;
+}
+
+static void slab_add(struct mem_cache *cache, struct mem_slab *slab)
+{
+    slab_link(&cache->partial, slab);
+    cache->n_slabs++;
+    cache->n_empty++;
+}
+
+static void slab_remove(struct mem_cache *cache, struct mem_slab *slab)
+{
+    slab_unlink(&cache->partial, slab);
+    cache->n_slabs--;
+    cache->n_empty--;
+}
+
+static i32 cache_setup(struct mem_cache *cache, const char *name, usize size,
+                       usize align)
+{
+    u32 pages;
+    u32 irq;
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (align & (align - 1))
+        return EINVAL;
+
+    cache->name = name;
+    cache->align = align;
+    cache->size = align_up(size ? size : 1, align);
+    cache->offset = align_up(sizeof(struct mem_slab), align);
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->n_slabs = 0;
+    cache->n_empty = 0;
+    cache->n_active = 0;
+    cache->lock_num = next_striped_spin_lock_num();
+
+    /* Use the smallest slab which fits a couple of objects, so the header
+       overhead stays low for the bigger ones. */
+
+    for (pages = 1; pages < SLAB_MAX_PAGES; pages++) {
+        if ((pages * PAGE_SIZE - cache->offset) / cache->size
+            >= SLAB_MIN_OBJECTS)
+            break;
+    }
+
+    if (pages * PAGE_SIZE < cache->offset + cache->size)
+        return ENOMEM;
+
+    cache->slab_pages = pages;
+    cache->per_slab = (pages * PAGE_SIZE - cache->offset) / cache->size;
+
+    irq = save_and_disable_interrupts();
+    cache->next = caches;
+    caches = cache;
+    restore_interrupts(irq);
+
+    return 0;
+}
+
+struct mem_cache *mem_cache_create(const char *name, usize size, usize align)
+{
+    struct mem_cache *cache;
+
+    /* The cache structures themselves come from a static cache, set up by
+       _mem_cache_init. */
+
+    cache = mem_cache_alloc(&cache_cache);
+    if (!cache)
+        return NULL;
+
+    if (cache_setup(cache, name, size, align)) {
+        mem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void *mem_cache_alloc(struct mem_cache *cache)
+{
+    struct mem_slab *slab;
+    spin_lock_t *lock;
+    void *obj;
+    u32 irq;
+
+    lock = spin_lock_instance(cache->lock_num);
+    irq = spin_lock_blocking(lock);
+
+    /* The other core may have added a slab while we were making ours, then
+       there is just one more empty slab around. */
+
+    while (!(slab = cache->partial)) {
+        spin_unlock(lock, irq);
+        if (!(slab = slab_create(cache)))
+            return NULL;
+        irq = spin_lock_blocking(lock);
+        slab_add(cache, slab);
+    }
+
+    obj = slab->freelist;
+    slab->freelist = *(void **) obj;
+
+    if (!slab->inuse++)
+        cache->n_empty--;
+
+    if (!slab->freelist) {
+        slab_unlink(&cache->partial, slab);
+        slab_link(&cache->full, slab);
+    }
+
+    cache->n_active++;
+    spin_unlock(lock, irq);
+
+    return obj;
+}
+
+void mem_cache_free(struct mem_cache *cache, void *obj)
+{
+    struct mem_slab *empty;
+    struct mem_slab *slab;
+    spin_lock_t *lock;
+    u32 irq;
+
+    if (!obj)
+        return;
+
+    slab = slab_of(obj);
+    if (slab->cache != cache)
+        panic("mem_cache_free: object does not belong to %s", cache->name);
+
+    lock = spin_lock_instance(cache->lock_num);
+    irq = spin_lock_blocking(lock);
+
+    if (!slab->freelist) {
+        slab_unlink(&cache->full, slab);
+        slab_link(&cache->partial, slab);
+    }
+
+    *(void **) obj = slab->freelist;
+    slab->freelist = obj;
+    cache->n_active--;
+
+    /* Keep a single empty slab, give the rest back to the page heap. */
+
+    empty = NULL;
+    if (!--slab->inuse) {
+        cache->n_empty++;
+        if (cache->n_empty > 1) {
+            slab_remove(cache, slab);
+            empty = slab;
+        }
+    }
+
+    spin_unlock(lock, irq);
+
+    if (empty)
+        page_free(empty);
+}
+
+struct mem_cache *mem_cache_of(void *obj)
+{
+    return slab_of(obj)->cache;
+}
+
+void _mem_cache_init()
+{
+    /* Called once by _mem_init, before the other core is running. */
+
+    cache_setup(&cache_cache, "mem_cache", sizeof(struct mem_cache), 0);
+}
+
+void mem_cache_info()
+{
+    struct mem_cache *cache;
+
+    if (!caches)
+        return;
+
+    syslog("Slab caches:");
+
+    for (cache = caches; cache; cache = cache->next) {
+        syslog("  %-16s %4zu B  %3u/%-3u objects  %u slabs of %u pages",
+               cache->name, cache->size, cache->n_active,
+               cache->n_slabs * cache->per_slab, cache->n_slabs,
+               cache->slab_pages);
+    }
+}
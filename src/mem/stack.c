@@ -0,0 +1,145 @@
+/* mem/stack.c - stack usage tracking
+   Copyright (c) 2025 bellrise */
+
+#include <hardware/sync.h>
+#include <micron/buildconfig.h>
+#include <micron/mem.h>
+#include <micron/syslog.h>
+#include <pico/time.h>
+
+/* The unused part of each stack is filled with a known pattern. The lowest
+   word which no longer holds it tells us how deep the stack has ever been.
+   Core 0 runs on the main stack in SCRATCH_Y, core 1 on the stack given to
+   multicore_launch_core1, which is placed in SCRATCH_X. */
+
+#define STACK_PAINT 0x5A5A5A5A
+
+#if PICO_ON_DEVICE
+extern u32 __StackBottom;
+extern u32 __StackTop;
+extern u32 __StackOneBottom;
+extern u32 __StackOneTop;
+#else
+/* Host threads run on stacks from the C library, which we know nothing
+   about, so both stacks are empty. */
+static u32 host_stack;
+# define __StackBottom    host_stack
+# define __StackTop       host_stack
+# define __StackOneBottom host_stack
+# define __StackOneTop    host_stack
+#endif
+
+static struct repeating_timer stack_timer;
+static bool stack_warned[2];
+static volatile bool stack_painted[2];
+static volatile usize stack_used[2]; /* waiting for stack_report */
+
+static void stack_bounds(u32 core, u32 **bottom, u32 **top)
+{
+    *bottom = core ? &__StackOneBottom : &__StackBottom;
+    *top = core ? &__StackOneTop : &__StackTop;
+}
+
+void stack_paint(u32 core)
+{
+    u32 *bottom;
+    u32 *word;
+    u32 *top;
+
+    stack_bounds(core, &bottom, &top);
+    if (bottom == top)
+        return;
+
+    /* Painting our own stack has to stop a bit below the current frame. */
+
+    if (core == get_core_num())
+        top = (u32 *) __builtin_frame_address(0) - 16;
+
+    for (word = bottom; word < top; word++)
+        *word = STACK_PAINT;
+
+    stack_painted[core] = true;
+}
+
+usize stack_size(u32 core)
+{
+    u32 *bottom;
+    u32 *top;
+
+    stack_bounds(core, &bottom, &top);
+    return (uptr) top - (uptr) bottom;
+}
+
+usize stack_high_water(u32 core)
+{
+    u32 *bottom;
+    u32 *word;
+    u32 *top;
+
+    /* A stack which was never painted looks completely used. Core 1 is only
+       painted by net_init, so without the network it stays that way. */
+
+    if (!stack_painted[core])
+        return 0;
+
+    stack_bounds(core, &bottom, &top);
+
+    for (word = bottom; word < top && *word == STACK_PAINT; word++)
+        ;
+
+    return (uptr) top - (uptr) word;
+}
+
+static bool stack_check(struct repeating_timer *timer __unused)
+{
+    usize used;
+    usize size;
+
+    /* Note it once per core, when less than 1/8 of the stack was never used.
+       This is an alarm callback, so it can't log anything itself. */
+
+    for (u32 core = 0; core < 2; core++) {
+        if (stack_warned[core] || !stack_painted[core])
+            continue;
+
+        used = stack_high_water(core);
+        size = stack_size(core);
+
+        if (used > size - size / 8) {
+            stack_used[core] = used;
+            stack_warned[core] = true;
+        }
+    }
+
+    return true;
+}
+
+void stack_report()
+{
+    usize used;
+    u32 irq;
+
+    /* Both cores may get here, the mem lock makes sure only one of them
+       takes the value. */
+
+    for (u32 core = 0; core < 2; core++) {
+        if (!stack_used[core])
+            continue;
+
+        irq = _mem_lock();
+        used = stack_used[core];
+        stack_used[core] = 0;
+        _mem_unlock(irq);
+
+        if (used) {
+            syslog(LOG_WARN "Core %u stack high water at %zu/%zu bytes", core,
+                   used, stack_size(core));
+        }
+    }
+}
+
+void stack_check_start()
+{
+    add_repeating_timer_ms(MICRON_CONFIG_STACK_CHECK, stack_check, NULL,
+                           &stack_timer);
+}
@@ -0,0 +1,68 @@
+/* mem/trace.c - page allocation tracing
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/mem.h>
+
+#if MICRON_CONFIG_MEM_TRACE
+
+# include <hardware/sync.h>
+# include <pico/time.h>
+
+/* Each core writes only into its own ring, with interrupts disabled, so
+   recording an event never takes a lock. Reading the ring of the other core
+   while it is allocating may return a half-written event, which is fine for
+   a debugging aid. */
+
+struct trace_ring
+{
+    u32 head; /* total events written, wraps around */
+    struct mem_trace_event events[MICRON_CONFIG_MEM_TRACE_EVENTS];
+};
+
+static struct trace_ring trace_rings[2];
+
+void _mem_trace(u8 type, void *addr, u32 pages, void *caller)
+{
+    struct mem_trace_event *event;
+    struct trace_ring *ring;
+    u32 core;
+    u32 irq;
+
+    irq = save_and_disable_interrupts();
+    core = get_core_num();
+    ring = &trace_rings[core];
+
+    event = &ring->events[ring->head++ % MICRON_CONFIG_MEM_TRACE_EVENTS];
+    event->time_us = time_us_32();
+    event->caller = caller;
+    event->addr = addr;
+    event->pages = pages;
+    event->type = type;
+    event->core = core;
+
+    restore_interrupts(irq);
+}
+
+u32 mem_trace_read(u32 core, struct mem_trace_event *events, u32 n)
+{
+    struct trace_ring *ring;
+    u32 head;
+    u32 i;
+
+    if (core > 1)
+        return 0;
+
+    ring = &trace_rings[core];
+    head = ring->head;
+
+    n = imin(n, imin(head, MICRON_CONFIG_MEM_TRACE_EVENTS));
+    for (i = 0; i < n; i++) {
+        events[i] =
+            ring->events[(head - n + i) % MICRON_CONFIG_MEM_TRACE_EVENTS];
+    }
+
+    return n;
+}
+
+#endif /* MICRON_CONFIG_MEM_TRACE */
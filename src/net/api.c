@@ -1,115 +1,429 @@
 /* net/ctrl.c - netctrl public API
    Copyright (c) 2024 bellrise */
 
+#include <micron/errno.h>
 #include <micron/net.h>
+#include <pico/time.h>
 
-static void netctrl(uptr cmd, void *args, usize n_args, void *res, usize n_res)
+u32 netctrl_submit(struct netctrl_req *req)
 {
     extern struct net __micron_net;
+    struct net *net;
+    u32 irq;
 
-    /* Communication between the main thread and the network thread is done by
-       using command queues. The user can send a command, like NC_SOCKET to
-       create a socket - and the network queue will allocate and initialize
-       the new socket once it has some time (isn't doing anything else).
+    /* Communication between the main thread and the network thread is done
+       with a ring of command descriptors. The user fills in a request, like
+       NC_SOCKET to create a socket, and the network thread runs it once it
+       has some time (isn't doing anything else), storing the result in the
+       request itself. Each caller waits on its own request, so any number of
+       commands can be in flight. The ring has a single consumer, but the
+       producers have to take turns. */
 
-       Then, it sends the result (in this case, a single pointer to a struct
-       netsock) to the ctrlres queue. */
+    net = &__micron_net;
+    req->done = false;
 
-    queue_add_blocking(&__micron_net.netctrl, &cmd);
-    for (usize i = 0; i < n_args; i++)
-        queue_add_blocking(&__micron_net.netctrl, &((uptr *) args)[i]);
-    for (usize i = 0; i < n_res; i++)
-        queue_remove_blocking(&__micron_net.ctrlres, &((uptr *) res)[i]);
+    while (1) {
+        irq = spin_lock_blocking(net->ctrl_lock);
+        if (ring_space(&net->ctrl))
+            break;
+        spin_unlock(net->ctrl_lock, irq);
+        __wfe();
+    }
+
+    req->id = ++net->last_ctrl_id;
+    ring_write(&net->ctrl, &req, 1);
+    spin_unlock(net->ctrl_lock, irq);
+
+    net_doorbell(net);
+
+    return req->id;
 }
 
-struct netsock *net_socket()
+iptr netctrl_wait(struct netctrl_req *req)
 {
-    struct netsock *sock;
+    /* The network thread sends an event after completing a batch. */
 
-    netctrl(NC_SOCKET, NULL, 0, &sock, 1);
+    while (!req->done)
+        __wfe();
 
-    return sock;
+    __dmb();
+    return req->res;
 }
 
-i32 net_connect(struct netsock *sock, ip_addr_t ip, u16 port)
+static iptr netctrl(u32 cmd, uptr arg0, uptr arg1, uptr arg2)
 {
-    uptr args[3];
-    uptr res;
+    struct netctrl_req req;
 
-    args[0] = (uptr) sock;
-    args[1] = (uptr) ip.addr;
-    args[2] = port;
+    req.cmd = cmd;
+    req.args[0] = arg0;
+    req.args[1] = arg1;
+    req.args[2] = arg2;
+    req.cb = NULL;
 
-    netctrl(NC_CONNECT, args, 3, &res, 1);
+    netctrl_submit(&req);
 
-    return res;
+    return netctrl_wait(&req);
 }
 
-i32 net_bind(struct netsock *sock, ip_addr_t ip, u16 port)
+struct netsock *net_socket()
 {
-    uptr args[3];
-    uptr res;
+    return (struct netsock *) netctrl(NC_SOCKET, 0, 0, 0);
+}
 
-    args[0] = (uptr) sock;
-    args[1] = (uptr) ip.addr;
-    args[2] = port;
+struct netsock *net_socket_udp()
+{
+    return (struct netsock *) netctrl(NC_UDP, 0, 0, 0);
+}
 
-    netctrl(NC_BIND, args, 3, &res, 1);
+i32 net_connect(struct netsock *sock, ip_addr_t ip, u16 port)
+{
+    return netctrl(NC_CONNECT, (uptr) sock, ip.addr, port);
+}
 
-    return res;
+i32 net_bind(struct netsock *sock, ip_addr_t ip, u16 port)
+{
+    return netctrl(NC_BIND, (uptr) sock, ip.addr, port);
 }
 
 i32 net_close(struct netsock *sock)
 {
-    uptr res;
+    /* Closing sends everything that's left, corked or not. */
+    sock->corked = false;
 
-    netctrl(NC_CLOSE, &sock, 1, &res, 1);
-
-    return res;
+    return netctrl(NC_CLOSE, (uptr) sock, 0, 0);
 }
 
 struct netsock *net_accept(struct netsock *sock)
 {
     struct netsock *client;
 
-    netctrl(NC_ACCEPT, &sock, 1, NULL, 0);
-    queue_remove_blocking(&sock->waiting_client, &client);
+    /* The listener accepts clients on its own, so we only have to take one
+       from the queue. Marking it as accepted lets the network thread make
+       room for another connection in the lwIP backlog. A listener which
+       lost its PCB won't queue anything again, so stop waiting then. */
+
+    while (!queue_try_remove(&sock->waiting_client, &client)) {
+        if (!sock->listening || (sock->flags & NS_NONBLOCK))
+            return NULL;
+        __wfe();
+    }
+
+    client->accepted = true;
+    net_doorbell(sock->net);
 
     return client;
 }
 
-u32 net_rx()
+void net_stat(struct net_stats *stats)
+{
+    extern struct net __micron_net;
+    u32 seq;
+
+    /* The network thread makes the sequence odd while it writes the block,
+       and even again once it's done. Retry if we saw it odd, or if it
+       changed while we were copying. */
+
+    do {
+        while ((seq = __micron_net.stats_seq) & 1)
+            ;
+        __dmb();
+        memcpy(stats, &__micron_net.stats, sizeof(*stats));
+        __dmb();
+    } while (seq != __micron_net.stats_seq);
+}
+
+iptr net_read(struct netsock *sock, void *buffer, usize size)
+{
+    /* The network thread sends an event every time it fills the read buffer,
+       so we can sleep until then. */
+
+    while (ring_is_empty(&sock->rbuf)) {
+        if (!sock->connected)
+            break;
+        if (sock->flags & NS_NONBLOCK)
+            return -EAGAIN;
+        __wfe();
+    }
+
+    if (ring_is_empty(&sock->rbuf) && sock->error)
+        return -sock->error;
+
+    return ring_read(&sock->rbuf, buffer, size);
+}
+
+iptr net_read_full(struct netsock *sock, void *buffer, usize size)
+{
+    usize read;
+    iptr n;
+
+    for (read = 0; read < size; read += n) {
+        n = net_read(sock, (u8 *) buffer + read, size - read);
+        if (n == -EAGAIN && !read)
+            return -EAGAIN;
+        if (n <= 0)
+            break;
+    }
+
+    return read;
+}
+
+iptr net_write(struct netsock *sock, const void *buffer, usize size)
+{
+    usize written;
+    usize n;
+
+    written = ring_write(&sock->wbuf, buffer, size);
+    if (written)
+        net_doorbell(sock->net);
+
+    if (sock->flags & NS_NONBLOCK) {
+        if (!written && size && sock->connected)
+            return -EAGAIN;
+        if (!written && size && sock->error)
+            return -sock->error;
+        return written;
+    }
+
+    while (written < size && sock->connected) {
+        __wfe();
+        n = ring_write(&sock->wbuf, (const u8 *) buffer + written,
+                       size - written);
+        if (n)
+            net_doorbell(sock->net);
+        written += n;
+    }
+
+    if (!written && size && sock->error)
+        return -sock->error;
+
+    return written;
+}
+
+static i32 net_queue_dgram(struct netsock *sock, const struct net_msg *msg)
 {
-    u32 type;
-    u32 rx;
+    struct net_dgram dgram;
+
+    /* The header and the payload go into the write buffer together, the
+       network thread only sends the datagram once all of it is there. */
+
+    if (msg->len > 0xffff || sizeof(dgram) + msg->len > sock->wbuf.count)
+        return EINVAL;
+    if (ring_space(&sock->wbuf) < sizeof(dgram) + msg->len)
+        return EAGAIN;
+
+    dgram.addr = msg->addr;
+    dgram.port = msg->port;
+    dgram.len = msg->len;
 
-    type = NCSTAT_RX;
-    netctrl(NC_STAT, &type, 1, &rx, 1);
+    ring_write(&sock->wbuf, &dgram, sizeof(dgram));
+    ring_write(&sock->wbuf, msg->buf, msg->len);
 
-    return rx;
+    return 0;
 }
 
-u32 net_tx()
+iptr net_sendmmsg(struct netsock *sock, const struct net_msg *msgs, u32 n)
 {
-    u32 type;
-    u32 tx;
+    u32 sent;
+    i32 err;
 
-    type = NCSTAT_TX;
-    netctrl(NC_STAT, &type, 1, &tx, 1);
+    err = 0;
+
+    for (sent = 0; sent < n; sent++) {
+        while ((err = net_queue_dgram(sock, &msgs[sent])) == EAGAIN) {
+            if (sock->flags & NS_NONBLOCK)
+                break;
+
+            /* Let the network thread drain what we have so far. */
+            net_doorbell(sock->net);
+            __wfe();
+        }
+
+        if (err)
+            break;
+    }
+
+    if (sent)
+        net_doorbell(sock->net);
+    if (!sent && err)
+        return -err;
+
+    return sent;
+}
 
-    return tx;
+i32 net_sendto(struct netsock *sock, const void *buf, usize len,
+               ip_addr_t addr, u16 port)
+{
+    struct net_msg msg;
+    iptr res;
+
+    msg.buf = buf;
+    msg.len = len;
+    msg.addr = addr;
+    msg.port = port;
+
+    res = net_sendmmsg(sock, &msg, 1);
+
+    return res < 0 ? res : 0;
+}
+
+iptr net_recvfrom(struct netsock *sock, void *buffer, usize size,
+                  ip_addr_t *addr, u16 *port)
+{
+    struct net_dgram dgram;
+    u32 read;
+
+    /* The network thread writes the payload before the descriptor, so once
+       we have the descriptor, all of the datagram is already in rbuf. */
+
+    while (!ring_read(&sock->dgrams, &dgram, 1)) {
+        if (sock->flags & NS_NONBLOCK)
+            return -EAGAIN;
+        __wfe();
+    }
+
+    read = ring_read(&sock->rbuf, buffer, imin(size, dgram.len));
+    ring_consume(&sock->rbuf, dgram.len - read);
+
+    if (addr)
+        *addr = dgram.addr;
+    if (port)
+        *port = dgram.port;
+
+    return dgram.len;
+}
+
+static u16 net_poll_revents(struct netsock *sock, u16 events)
+{
+    u16 revents;
+
+    revents = 0;
+
+    /* Everything here is published by core 1 through the rings and flags,
+       so we can read it without asking the network thread. */
+
+    if (!ring_is_empty(sock->udp ? &sock->dgrams : &sock->rbuf)
+        || !ring_is_empty(&sock->zc_rx))
+        revents |= NP_READ;
+    if (sock->connected && ring_space(&sock->wbuf))
+        revents |= NP_WRITE;
+    if (sock->listening && !queue_is_empty(&sock->waiting_client))
+        revents |= NP_ACCEPT;
+
+    /* A closed connection is always readable, net_read returns 0. */
+    if (!sock->connected && !sock->listening)
+        revents |= NP_READ | NP_CLOSED;
+
+    return revents & (events | NP_CLOSED);
+}
+
+i32 net_poll(struct net_pollfd *fds, u32 n, i32 timeout_ms)
+{
+    extern struct net __micron_net;
+    absolute_time_t deadline;
+    u32 seq;
+    i32 ready;
+
+    deadline = at_the_end_of_time;
+    if (timeout_ms > 0)
+        deadline = make_timeout_time_ms(timeout_ms);
+
+    while (1) {
+        /* Take the event counter before looking at the sockets, so that an
+           event which arrives while we check them wakes us up right away. */
+
+        seq = __micron_net.event_seq;
+        __dmb();
+
+        ready = 0;
+        for (u32 i = 0; i < n; i++) {
+            fds[i].revents = net_poll_revents(fds[i].sock, fds[i].events);
+            if (fds[i].revents)
+                ready++;
+        }
+
+        if (ready || !timeout_ms)
+            return ready;
+
+        while (seq == __micron_net.event_seq) {
+            if (best_effort_wfe_or_timeout(deadline))
+                return 0;
+        }
+    }
+}
+
+i32 net_recv_zc(struct netsock *sock, struct net_view *view)
+{
+    struct pbuf *seg;
+
+    while (!ring_read(&sock->zc_rx, &seg, 1)) {
+        if (!sock->connected && ring_is_empty(&sock->zc_rx))
+            return -EPIPE;
+        if (sock->flags & NS_NONBLOCK)
+            return -EAGAIN;
+        __wfe();
+    }
+
+    view->data = seg->payload;
+    view->len = seg->len;
+    view->seg = seg;
+    view->sock = sock;
+
+    return 0;
+}
+
+void net_recv_release(struct net_view *view)
+{
+    /* The network thread frees the pbuf and opens the window. It never has
+       more than NET_ZC_SEGMENTS segments out, which is the size of the
+       release ring, so there is always room for this one. */
+
+    ring_write(&view->sock->zc_release, &view->seg, 1);
+    net_doorbell(view->sock->net);
+    view->seg = NULL;
+}
+
+i32 net_write_zc(struct netsock *sock, const void *buf, usize len,
+                 net_done_fn done, void *arg)
+{
+    struct net_zc_tx tx;
+
+    if (!sock->connected)
+        return -EPIPE;
+
+    tx.buf = buf;
+    tx.len = len;
+    tx.wbuf_mark = sock->wbuf.head;
+    tx.end = 0;
+    tx.done = done;
+    tx.arg = arg;
+
+    while (!ring_write(&sock->zc_tx, &tx, 1)) {
+        if (!sock->connected)
+            return -EPIPE;
+        if (sock->flags & NS_NONBLOCK)
+            return -EAGAIN;
+        __wfe();
+    }
+
+    net_doorbell(sock->net);
+
+    return 0;
+}
+
+void net_cork(struct netsock *sock)
+{
+    sock->corked = true;
 }
 
-usize net_read(struct netsock *sock, void *buffer, usize size)
+void net_flush(struct netsock *sock)
 {
-    for (usize i = 0; i < size; i++)
-        queue_remove_blocking(&sock->rbuf, &((u8 *) buffer)[i]);
-    return size;
+    sock->corked = false;
+    __dmb();
+    sock->flushes++;
+    net_doorbell(sock->net);
 }
 
-usize net_write(struct netsock *sock, const void *buffer, usize size)
+void net_setflags(struct netsock *sock, u32 flags)
 {
-    for (usize i = 0; i < size; i++)
-        queue_add_blocking(&sock->wbuf, &((u8 *) buffer)[i]);
-    return size;
+    sock->flags = flags;
 }
@@ -0,0 +1,251 @@
+/* cyw43.c - CYW43 radio & network backend
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <pico.h>
+
+#if MICRON_CONFIG_NET && PICO_ON_DEVICE
+
+# include <hardware/flash.h>
+# include <hardware/sync.h>
+# include <micron/errno.h>
+# include <micron/syslog.h>
+# include <micron/wifi.h>
+# include <pico/cyw43_arch.h>
+# include <pico/multicore.h>
+# include <string.h>
+
+/* The Wi-Fi cache lives in the third sector from the end of flash, BTstack
+   keeps its pairing data in the last two. */
+# define RADIO_CACHE_OFFSET (PICO_FLASH_SIZE_BYTES - 3 * FLASH_SECTOR_SIZE)
+
+static int radio_scan_callback(struct wifi_scan *best,
+                               const cyw43_ev_scan_result_t *result)
+{
+    extern struct net __micron_net;
+
+    if (!result)
+        return 0;
+
+    syslog("Found ssid '%s' on channel %u", result->ssid, result->channel);
+
+    if (strcmp((const char *) result->ssid, __micron_net.w_ssid))
+        return 0;
+
+    /* Remember the strongest access point for the network. */
+
+    if (!__micron_net.w_found_networks++ || result->rssi > best->rssi) {
+        memcpy(best->bssid, result->bssid, sizeof(best->bssid));
+        best->channel = result->channel;
+        best->rssi = result->rssi;
+    }
+
+    return 0;
+}
+
+static i32 radio_scan(struct net *net, struct wifi_scan *best)
+{
+    cyw43_wifi_scan_options_t scan_opts;
+    i32 err;
+
+    cyw43_arch_enable_sta_mode();
+
+    /* Scan only matching SSIDs. */
+
+    memset(&scan_opts, 0, sizeof(scan_opts));
+    strcpy((char *) scan_opts.ssid, net->w_ssid);
+
+    err = cyw43_wifi_scan(&cyw43_state, &scan_opts, best,
+                          (void *) radio_scan_callback);
+    if (err)
+        return EIO;
+
+    /* Wait until the scan has finished, the results wake us up. */
+
+    while (cyw43_wifi_scan_active(&cyw43_state)) {
+        cyw43_arch_poll();
+        cyw43_arch_wait_for_work_until(make_timeout_time_ms(1000));
+    }
+
+    return net->w_found_networks ? 0 : ENOENT;
+}
+
+static i32 radio_join(struct net *net, const u8 *bssid, u16 channel)
+{
+    const char *passwd;
+    i32 err;
+
+    cyw43_arch_enable_sta_mode();
+    passwd = MICRON_CONFIG_NET_PASSWD;
+
+    err = cyw43_wifi_join(&cyw43_state, strlen(net->w_ssid),
+                          (const u8 *) net->w_ssid, strlen(passwd),
+                          (const u8 *) passwd, CYW43_AUTH_WPA2_AES_PSK, bssid,
+                          channel ? channel : CYW43_CHANNEL_NONE);
+
+    return err ? EIO : 0;
+}
+
+static i32 radio_status(struct net *__unused net)
+{
+    switch (cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA)) {
+    case CYW43_LINK_UP:
+        return WIFI_UP;
+    case CYW43_LINK_FAIL:
+        return -EIO;
+    case CYW43_LINK_NONET:
+        return -ENOENT;
+    case CYW43_LINK_BADAUTH:
+        return -EACCES;
+    default:
+        return WIFI_JOINING;
+    }
+}
+
+static void radio_leave(struct net *__unused net)
+{
+    cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+}
+
+static void radio_wait(struct net *__unused net, absolute_time_t until)
+{
+    cyw43_arch_poll();
+    cyw43_arch_wait_for_work_until(until);
+}
+
+static i32 radio_load(struct wifi_cache *cache)
+{
+    memcpy(cache, (const void *) (XIP_BASE + RADIO_CACHE_OFFSET),
+           sizeof(*cache));
+
+    return 0;
+}
+
+static void radio_save(const struct wifi_cache *cache)
+{
+    u8 page[FLASH_PAGE_SIZE];
+    u32 irq;
+
+    /* This runs from wifi_init, before the network thread is started, so
+       core 1 isn't running anything from flash. Only the interrupts on
+       this core have to stay away from XIP while it's being written. */
+
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, cache, sizeof(*cache));
+
+    irq = save_and_disable_interrupts();
+    flash_range_erase(RADIO_CACHE_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(RADIO_CACHE_OFFSET, page, FLASH_PAGE_SIZE);
+    restore_interrupts(irq);
+}
+
+const struct wifi_radio wifi_cyw43_radio = {
+    .scan = radio_scan,
+    .join = radio_join,
+    .status = radio_status,
+    .leave = radio_leave,
+    .wait = radio_wait,
+    .load = radio_load,
+    .save = radio_save,
+};
+
+/* CYW43 backend. The radio is driven by the cyw43_arch poll context, which
+   also runs the lwIP timers. */
+
+static async_when_pending_worker_t wifi_doorbell;
+
+static void wifi_doorbell_work(async_context_t *__unused context,
+                                async_when_pending_worker_t *__unused worker)
+{
+    /* Nothing to do here, net_thread does the work once it wakes up. */
+}
+
+static i32 wifi_backend_init(struct net *net)
+{
+    if (!MICRON_CONFIG_NET_WIFI)
+        return ENOENT;
+
+    net->w_radio = &wifi_cyw43_radio;
+    wifi_init(net);
+
+    wifi_doorbell.do_work = wifi_doorbell_work;
+    async_context_add_when_pending_worker(cyw43_arch_async_context(),
+                                          &wifi_doorbell);
+
+    return 0;
+}
+
+static void wifi_start(struct net *__unused net, void (*thread)())
+{
+    multicore_launch_core1(thread);
+}
+
+static i32 wifi_link(struct net *__unused net)
+{
+    i32 link;
+    i32 rssi;
+
+    /* Only up once DHCP has given us an address, so that a reconnect isn't
+       done before the sockets can be used again. */
+
+    link = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+    if (link != CYW43_LINK_UP) {
+        cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, false);
+        return link < 0 ? link : 0;
+    }
+
+    /* WARNING: this line is very important - it seems like it isn't doing
+       much, but not checking the connection RSSI will end up stopping all
+       network traffic from reaching interface. :( */
+    cyw43_wifi_get_rssi(&cyw43_state, &rssi);
+    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, true);
+
+    return 1;
+}
+
+static void wifi_poll(struct net *__unused net)
+{
+    cyw43_arch_poll();
+}
+
+static void wifi_wait(struct net *__unused net, absolute_time_t until)
+{
+    /* The async context also wakes up for the radio and its own timers. */
+    cyw43_arch_wait_for_work_until(until);
+}
+
+static void wifi_wake(struct net *__unused net)
+{
+    /* Releases the semaphore the async context sleeps on, which is what a
+       plain SEV can't do. */
+    async_context_set_work_pending(cyw43_arch_async_context(),
+                                   &wifi_doorbell);
+}
+
+static void wifi_reconnect(struct net *net, u32 attempt)
+{
+    /* Go straight back to the access point we lost first. If that doesn't
+       work, let the driver look for the network, it may have moved to
+       another channel or access point. The flash cache is left alone, it
+       can't be written while core 0 runs from flash. */
+
+    net->w_radio->leave(net);
+
+    if (!attempt)
+        net->w_radio->join(net, net->w_bssid.addr, net->w_channel);
+    else
+        net->w_radio->join(net, NULL, 0);
+}
+
+const struct net_backend net_cyw43_backend = {
+    .name = "wifi",
+    .init = wifi_backend_init,
+    .start = wifi_start,
+    .link = wifi_link,
+    .poll = wifi_poll,
+    .wait = wifi_wait,
+    .wake = wifi_wake,
+    .reconnect = wifi_reconnect,
+};
+
+#endif /* MICRON_CONFIG_NET && PICO_ON_DEVICE */
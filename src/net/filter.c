@@ -1,11 +1,211 @@
 /* netfilter.c - network filtering rules
    Copyright (c) 2024 bellrise */
 
+#include <lwip/pbuf.h>
+#include <lwip/prot/iana.h>
+#include <lwip/prot/icmp.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/tcp.h>
+#include <lwip/prot/udp.h>
+#include <lwip/udp.h>
 #include <micron/netfilter.h>
 
-bool netfilter_lan_addr(const ip_addr_t *remote)
+#if MICRON_CONFIG_NET && defined(MICRON_NETFILTER_TABLE)
+
+/* Same as in lwIP's udp.c, which keeps it to itself. */
+#ifndef UDP_LOCAL_PORT_RANGE_START
+# define UDP_LOCAL_PORT_RANGE_START 0xc000
+#endif
+
+/* The rules come from NET_FILTER in the config. mkgenconfig turns them into
+   a sorted table of address ranges, each listing the rules which cover it
+   in the order they should be tried, so a packet costs a binary search and
+   a couple of compares. The last hit counter is for packets no rule took. */
+
+static const struct netfilter_rule netfilter_rules[] = MICRON_NETFILTER_RULES;
+static const struct netfilter_range netfilter_table[] = MICRON_NETFILTER_TABLE;
+static const u8 netfilter_matches[] = MICRON_NETFILTER_MATCHES;
+static u32 netfilter_hit[MICRON_NETFILTER_NRULES + 1];
+
+static const struct netfilter_range *netfilter_find(u32 addr)
+{
+    const struct netfilter_range *range;
+    u32 lo;
+    u32 hi;
+
+    lo = 0;
+    hi = MICRON_NETFILTER_NRANGES;
+
+    while (lo < hi) {
+        range = &netfilter_table[(lo + hi) / 2];
+        if (addr < range->lo)
+            hi = (lo + hi) / 2;
+        else if (addr > range->hi)
+            lo = (lo + hi) / 2 + 1;
+        else
+            return range;
+    }
+
+    return NULL;
+}
+
+static bool netfilter_check(u32 addr, u8 proto, u16 port)
+{
+    const struct netfilter_range *range;
+    const struct netfilter_rule *rule;
+    u32 id;
+
+    if ((range = netfilter_find(addr))) {
+        for (u32 i = 0; i < range->count; i++) {
+            id = netfilter_matches[range->first + i];
+            rule = &netfilter_rules[id];
+
+            if (rule->proto && rule->proto != proto)
+                continue;
+            if (port < rule->port_lo || port > rule->port_hi)
+                continue;
+
+            netfilter_hit[id]++;
+            return rule->allow;
+        }
+    }
+
+    netfilter_hit[MICRON_NETFILTER_NRULES]++;
+    return false;
+}
+
+static bool netfilter_udp_expected(struct ip_hdr *ip, struct udp_hdr *udp)
 {
-    /* Check for 192.168.0.0/16 or 10.0.0.0/8 addresses. */
+    struct udp_pcb *pcb;
+    u16 dest;
+    u16 src;
+
+    /* A datagram is an answer if it's for a socket connected to the sender,
+       or for one lwIP bound for us: the DHCP client, or a socket which was
+       only ever used to send and got an ephemeral port. Datagrams for ports
+       bound on purpose go through the rules. We run on the network thread,
+       so the PCB list can't change under us. */
+
+    dest = lwip_ntohs(udp->dest);
+    src = lwip_ntohs(udp->src);
+
+    for (pcb = udp_pcbs; pcb; pcb = pcb->next) {
+        if (pcb->local_port != dest)
+            continue;
+        if (pcb->local_ip.addr && pcb->local_ip.addr != ip->dest.addr)
+            continue;
 
-    return (remote->addr & 0xffff) == 0xa8c0 || (remote->addr & 0xff) == 10;
+        if (pcb->flags & UDP_FLAGS_CONNECTED) {
+            if (pcb->remote_port == src && pcb->remote_ip.addr == ip->src.addr)
+                return true;
+            continue;
+        }
+
+        if (dest == LWIP_IANA_PORT_DHCP_CLIENT
+            || dest >= UDP_LOCAL_PORT_RANGE_START)
+            return true;
+    }
+
+    return false;
 }
+
+int netfilter_input(struct pbuf *packet, struct netif *__unused iface)
+{
+    struct icmp_echo_hdr *icmp;
+    struct tcp_hdr *tcp;
+    struct udp_hdr *udp;
+    struct ip_hdr *ip;
+    u32 ip_size;
+    u16 port;
+    u8 proto;
+
+    /* Called by ip4_input as soon as it sees an IPv4 header, so dropping
+       here is the cheapest it can be. Nothing past the version is checked
+       yet, anything odd is left for lwIP to drop. Only traffic which would
+       start something on our side is filtered: pings, datagrams to a bound
+       port and TCP connection requests. Answers to our own connections and
+       lookups go through, and so do ICMP errors, which lwIP only passes on
+       to the connection they are about. */
+
+    ip = packet->payload;
+    ip_size = IPH_HL_BYTES(ip);
+    proto = IPH_PROTO(ip);
+    port = 0;
+
+    if (ip_size < IP_HLEN || packet->len < ip_size)
+        return 0;
+
+    /* Fragments past the first have no transport header, they can't be put
+       back together without the first one anyway. */
+
+    if (lwip_ntohs(IPH_OFFSET(ip)) & IP_OFFMASK)
+        return 0;
+
+    switch (proto) {
+    case IP_PROTO_ICMP:
+        if (packet->len < ip_size + sizeof(*icmp))
+            return 0;
+        icmp = packet->payload + ip_size;
+        if (ICMPH_TYPE(icmp) != ICMP_ECHO)
+            return 0;
+        break;
+    case IP_PROTO_TCP:
+        if (packet->len < ip_size + sizeof(*tcp))
+            return 0;
+        tcp = packet->payload + ip_size;
+        if ((TCPH_FLAGS(tcp) & (TCP_SYN | TCP_ACK)) != TCP_SYN)
+            return 0;
+        port = lwip_ntohs(tcp->dest);
+        break;
+    case IP_PROTO_UDP:
+        if (packet->len < ip_size + sizeof(*udp))
+            return 0;
+        udp = packet->payload + ip_size;
+        if (netfilter_udp_expected(ip, udp))
+            return 0;
+        port = lwip_ntohs(udp->dest);
+        break;
+    default:
+        return 0;
+    }
+
+    if (netfilter_check(lwip_ntohl(ip->src.addr), proto, port))
+        return 0;
+
+    pbuf_free(packet);
+    return 1;
+}
+
+u32 netfilter_nrules()
+{
+    return MICRON_NETFILTER_NRULES + 1;
+}
+
+const char *netfilter_rule(u32 rule, u32 *hits)
+{
+    *hits = netfilter_hit[rule];
+
+    if (rule == MICRON_NETFILTER_NRULES)
+        return "deny unmatched";
+    return netfilter_rules[rule].name;
+}
+
+#else
+
+int netfilter_input(struct pbuf *__unused packet, struct netif *__unused iface)
+{
+    return 0;
+}
+
+u32 netfilter_nrules()
+{
+    return 0;
+}
+
+const char *netfilter_rule(u32 __unused rule, u32 *hits)
+{
+    *hits = 0;
+    return NULL;
+}
+
+#endif /* MICRON_CONFIG_NET && MICRON_NETFILTER_TABLE */
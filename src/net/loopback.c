@@ -0,0 +1,187 @@
+/* net/loopback.c - in-memory network backend for host builds
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <pico.h>
+
+#if MICRON_CONFIG_NET && !PICO_ON_DEVICE
+
+# include <lwip/init.h>
+# include <lwip/ip.h>
+# include <lwip/netif.h>
+# include <lwip/pbuf.h>
+# include <lwip/stats.h>
+# include <lwip/timeouts.h>
+# include <micron/host.h>
+# include <micron/net.h>
+# include <micron/syslog.h>
+# include <pthread.h>
+# include <time.h>
+
+/* The loopback backend lets net.c and api.c run unchanged on a workstation.
+   A single lwIP interface answers on 10.0.0.1/24, and everything it sends is
+   received again by the same interface, so a client and a server socket on
+   the same stack talk to each other through the whole TCP/IP path. A pthread
+   stands in for core 1. */
+
+# define LOOP_QUEUE 64
+
+static struct netif loop_iface;
+static struct ring loop_queue;
+static struct pbuf *loop_queue_data[LOOP_QUEUE];
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loop_cond = PTHREAD_COND_INITIALIZER;
+static bool loop_woken;
+
+u32_t sys_now(void)
+{
+    return to_ms_since_boot(get_absolute_time());
+}
+
+static err_t loop_output(struct netif *__unused iface, struct pbuf *packet,
+                         const ip4_addr_t *__unused addr)
+{
+    struct pbuf *copy;
+
+    /* lwIP keeps the packet around for retransmits, so queue a copy. It's
+       received on the next poll, delivering it right away would re-enter
+       lwIP from its own output path. */
+
+    if (!ring_space(&loop_queue)) {
+        LINK_STATS_INC(link.drop);
+        return ERR_MEM;
+    }
+
+    if (!(copy = pbuf_clone(PBUF_RAW, PBUF_RAM, packet))) {
+        LINK_STATS_INC(link.memerr);
+        return ERR_MEM;
+    }
+
+    ring_write(&loop_queue, &copy, 1);
+    LINK_STATS_INC(link.xmit);
+
+    return ERR_OK;
+}
+
+static err_t loop_iface_init(struct netif *iface)
+{
+    iface->name[0] = 'l';
+    iface->name[1] = 'o';
+    iface->mtu = 1500;
+    iface->output = loop_output;
+
+    return ERR_OK;
+}
+
+static i32 loop_init(struct net *net)
+{
+    ip4_addr_t addr;
+    ip4_addr_t mask;
+    ip4_addr_t gw;
+
+    ring_init(&loop_queue, loop_queue_data, LOOP_QUEUE, sizeof(struct pbuf *));
+    lwip_init();
+
+    IP4_ADDR(&addr, 10, 0, 0, 1);
+    IP4_ADDR(&mask, 255, 255, 255, 0);
+    IP4_ADDR(&gw, 10, 0, 0, 1);
+
+    netif_add(&loop_iface, &addr, &mask, &gw, NULL, loop_iface_init,
+              ip_input);
+    netif_set_default(&loop_iface);
+    netif_set_up(&loop_iface);
+    netif_set_link_up(&loop_iface);
+
+    syslog("loopback: ip %s", ipaddr_ntoa(&loop_iface.ip_addr));
+    net->iface = &loop_iface;
+
+    return 0;
+}
+
+static void *loop_thread(void *thread)
+{
+    host_set_core(1);
+    ((void (*)()) thread)();
+    return NULL;
+}
+
+static void loop_start(struct net *__unused net, void (*thread)())
+{
+    pthread_t id;
+
+    pthread_create(&id, NULL, loop_thread, (void *) thread);
+    pthread_detach(id);
+}
+
+static i32 loop_link(struct net *__unused net)
+{
+    return 1;
+}
+
+static void loop_poll(struct net *__unused net)
+{
+    struct pbuf *packet;
+    u32 n;
+
+    /* Only what was queued before the poll, the replies wait for the next
+       one so a busy connection can't starve the rest of net_thread. */
+
+    n = ring_level(&loop_queue);
+
+    while (n-- && ring_read(&loop_queue, &packet, 1)) {
+        LINK_STATS_INC(link.recv);
+        if (loop_iface.input(packet, &loop_iface) != ERR_OK)
+            pbuf_free(packet);
+    }
+
+    sys_check_timeouts();
+}
+
+static void loop_wait(struct net *__unused net, absolute_time_t until)
+{
+    struct timespec deadline;
+    int64_t us;
+
+    /* Packets sent during the last poll are waiting to be received. */
+
+    if (!ring_is_empty(&loop_queue))
+        return;
+
+    us = absolute_time_diff_us(get_absolute_time(), until);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += us / 1000000;
+    deadline.tv_nsec += (us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&loop_lock);
+    while (!loop_woken) {
+        if (pthread_cond_timedwait(&loop_cond, &loop_lock, &deadline))
+            break;
+    }
+    loop_woken = false;
+    pthread_mutex_unlock(&loop_lock);
+}
+
+static void loop_wake(struct net *__unused net)
+{
+    pthread_mutex_lock(&loop_lock);
+    loop_woken = true;
+    pthread_cond_signal(&loop_cond);
+    pthread_mutex_unlock(&loop_lock);
+}
+
+const struct net_backend net_loopback_backend = {
+    .name = "loopback",
+    .init = loop_init,
+    .start = loop_start,
+    .link = loop_link,
+    .poll = loop_poll,
+    .wait = loop_wait,
+    .wake = loop_wake,
+    .reconnect = NULL,
+};
+
+#endif /* MICRON_CONFIG_NET && !PICO_ON_DEVICE */
@@ -1,76 +1,120 @@
 /* net.c - network operations
    Copyright (c) 2024 bellrise */
 
-#include <boards/pico_w.h>
 #include <lwip/icmp.h>
 #include <lwip/inet_chksum.h>
 #include <lwip/raw.h>
 #include <lwip/stats.h>
 #include <lwip/tcp.h>
+#include <lwip/timeouts.h>
+#include <lwip/udp.h>
 #include <micron/buildconfig.h>
 #include <micron/errno.h>
 #include <micron/mem.h>
 #include <micron/micron.h>
 #include <micron/net.h>
-#include <micron/netfilter.h>
 #include <micron/syslog.h>
-#include <micron/wifi.h>
 #include <netif/ethernet.h>
-#include <pico/cyw43_arch.h>
-#include <pico/multicore.h>
+#include <pico.h>
+
+u16 net_chksum_adjust(u16 sum, u16 old, u16 new)
+{
+    u32 acc;
+
+    /* Incremental update from RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m'). The
+       one's complement sum doesn't care about byte order, so the words can
+       be used just as they are in the packet. */
+
+    acc = (u16) ~sum + (u16) ~old + new;
+    acc = (acc & 0xffff) + (acc >> 16);
+    acc = (acc & 0xffff) + (acc >> 16);
+
+    /* The sum comes out as 0xffff both for data which really sums to that,
+       and for data which is all zeros. Only 0xffff is right for the latter,
+       and either one verifies for the former, so never return 0. */
+
+    return acc == 0xffff ? 0xffff : (u16) ~acc;
+}
+
+static bool icmp_admit(struct net *net)
+{
+#if MICRON_CONFIG_NET_ICMP_RATE
+    u32 elapsed;
+    u32 period;
+    u32 burst;
+    u32 now;
+
+    /* Token bucket, kept in microseconds of credit. Every reply costs one
+       period, and the credit never goes over a full burst. */
+
+    period = 1000000 / MICRON_CONFIG_NET_ICMP_RATE;
+    burst = period * MICRON_CONFIG_NET_ICMP_BURST;
+    now = time_us_32();
+
+    elapsed = now - net->icmp_refill_at;
+    net->icmp_refill_at = now;
+    net->icmp_credit_us += elapsed < burst ? elapsed : burst;
+    if (net->icmp_credit_us > burst)
+        net->icmp_credit_us = burst;
+
+    if (net->icmp_credit_us < period)
+        return false;
+
+    net->icmp_credit_us -= period;
+#endif
+    return true;
+}
 
 /**
- * Callback when receiving ICMP packets. Allows only ICMP requests from the same
- * network, and only ECHO REQUEST packets. The rest is dropped.
+ * Callback when receiving ICMP packets, which already went through netfilter.
+ * Only ECHO REQUEST packets are answered, the rest is dropped.
  */
-static u8 icmp_recv(struct net *__unused net, struct raw_pcb *block,
+static u8 icmp_recv(struct net *net, struct raw_pcb *block,
                     struct pbuf *packet, const ip_addr_t *remote_addr)
 {
     struct icmp_hdr *icmp;
-    struct pbuf *reply;
-    u32 payload_len;
     u32 icmp_size;
     u32 ip_size;
-    u32 rq_data;
+    u16 old;
 
     icmp_size = sizeof(struct icmp_hdr);
-    ip_size = sizeof(struct ip_hdr);
+    ip_size = IPH_HL_BYTES((struct ip_hdr *) packet->payload);
 
-    /* Drop any packets that are not from the same network and that have
-       a strange size. */
+    /* Drop any packets that have a strange size. */
 
-    if (!netfilter_lan_addr(remote_addr))
-        goto drop;
     if (packet->len < ip_size + icmp_size)
         goto drop;
 
     icmp = packet->payload + ip_size;
-    payload_len = packet->len - ip_size - icmp_size;
-    rq_data = icmp->data;
 
     /* Reply only to echo requests. */
 
     if (icmp->type != ICMP_ECHO)
         goto drop;
 
-    reply = pbuf_alloc(PBUF_IP, packet->len - ip_size, PBUF_RAM);
-    icmp = reply->payload;
+    if (!icmp_admit(net)) {
+        net->icmp_limited++;
+        goto free;
+    }
 
-    /* Echo reply, send back the same data & payload as the request. */
+    /* Echo reply, send back the same data & payload as the request. Only the
+       type changes, so the reply is built in the request itself and the
+       checksum is updated instead of summing the payload again. Hiding the
+       IP header leaves room for raw_sendto to put a new one in its place. */
 
+    old = *(u16 *) icmp;
     icmp->type = ICMP_ER;
-    icmp->data = rq_data;
-    icmp->chksum = 0;
     icmp->code = 0;
+    icmp->chksum = net_chksum_adjust(icmp->chksum, old, *(u16 *) icmp);
 
-    memcpy(reply->payload + icmp_size, packet->payload + icmp_size + ip_size,
-           payload_len);
-
-    icmp->chksum = inet_chksum(icmp, icmp_size + payload_len);
-    raw_sendto(block, reply, remote_addr);
-    pbuf_free(reply);
+    pbuf_remove_header(packet, ip_size);
+    raw_sendto(block, packet, remote_addr);
+    net->icmp_replies++;
+    goto free;
 
 drop:
+    net->icmp_drops++;
+free:
     pbuf_free(packet);
     return 1;
 }
@@ -90,122 +134,616 @@ static void icmp_serve(struct net *net)
     syslog("icmp: Serving ICMP packets");
 }
 
+static void net_notify(struct net *net)
+{
+    /* Something changed in one of the sockets. Bump the event counter, so
+       net_poll knows to look again, and wake up the other core. */
+
+    net->event_seq++;
+    __sev();
+}
+
+void net_doorbell(struct net *net)
+{
+    /* Only the first ring after the network thread has looked at the rings
+       does anything, the rest of the work is picked up along with it. The
+       barrier orders the ring_commit before reading the flag, net_thread
+       does the same the other way round, so one of us sees the other. */
+
+    __dmb();
+    if (net->doorbell_rung)
+        return;
+
+    net->doorbell_at = time_us_32();
+    __dmb();
+    net->doorbell_rung = true;
+    net->backend->wake(net);
+}
+
+static void net_doorbell_add(struct net *net, u32 us)
+{
+    net->doorbell_count++;
+    net->doorbell_total_us += us;
+    net->doorbell_max_us = imax(net->doorbell_max_us, us);
+}
+
+static void netsock_destroy(struct net *net, struct netsock *sock)
+{
+    mem_cache_free(net->rwbuf_cache, sock->rbuf.data);
+    mem_cache_free(net->rwbuf_cache, sock->wbuf.data);
+    mem_cache_free(net->sock_cache, sock);
+}
+
+static void netsock_queue_init(queue_t *queue, void *data, u32 element_size,
+                               u32 element_count)
+{
+    /* Same as queue_init, but the element storage is provided by the caller,
+       so it can come from a slab cache instead of calloc. The storage needs
+       space for element_count + 1 elements. */
+
+    lock_init(&queue->core, next_striped_spin_lock_num());
+    queue->data = data;
+    queue->element_size = element_size;
+    queue->element_count = element_count;
+    queue->wptr = 0;
+    queue->rptr = 0;
+}
+
 static struct netsock *netsock_create(struct net *net)
 {
     struct netsock *sock;
 
-    sock = malloc(sizeof(*sock));
-    sock->tmpbuf = malloc(MICRON_CONFIG_NET_RWBUF);
-    sock->id = ++net->last_netsock_id;
+    /* All netsock memory comes from the object caches, so accepting and
+       closing connections just recycles the same slab objects. */
+
+    sock = mem_cache_alloc(net->sock_cache);
+    if (!sock)
+        return NULL;
+
+    ring_init(&sock->rbuf, mem_cache_alloc(net->rwbuf_cache),
+              MICRON_CONFIG_NET_RWBUF, sizeof(u8));
+    ring_init(&sock->wbuf, mem_cache_alloc(net->rwbuf_cache),
+              MICRON_CONFIG_NET_RWBUF, sizeof(u8));
+    ring_init(&sock->zc_rx, sock->zc_rx_data, NET_ZC_SEGMENTS,
+              sizeof(struct pbuf *));
+    ring_init(&sock->zc_release, sock->zc_release_data, NET_ZC_SEGMENTS,
+              sizeof(struct pbuf *));
+    ring_init(&sock->zc_tx, sock->zc_tx_data, NET_ZC_TX,
+              sizeof(struct net_zc_tx));
+    ring_init(&sock->dgrams, sock->dgrams_data, NET_DGRAMS,
+              sizeof(struct net_dgram));
+    netsock_queue_init(&sock->waiting_client, sock->waiting_client_data,
+                       sizeof(uptr), MICRON_CONFIG_NET_BACKLOG);
+
+    if (!sock->rbuf.data || !sock->wbuf.data) {
+        netsock_destroy(net, sock);
+        return NULL;
+    }
+
+    sock->flags = 0;
+    sock->zc_pending = NULL;
+    sock->zc_held = 0;
+    sock->zc_tx_next = 0;
+    sock->zc_tx_offset = 0;
+    sock->tx_written = 0;
+    sock->tx_acked = 0;
+    sock->closing = false;
+    sock->listening = false;
+    sock->corked = false;
+    sock->flushes = 0;
+    sock->flushes_seen = 0;
+    sock->tx_response_mark = 0;
+    sock->rx_bytes = 0;
+    sock->rx_drops = 0;
     sock->addr.addr = 0;
     sock->port = 0;
     sock->connected = false;
+    sock->error = 0;
+    sock->accepted = false;
+    sock->backlogged = false;
     sock->packet_read_offset = 0;
+    sock->tcp = NULL;
+    sock->udp = NULL;
     sock->net = net;
-    queue_init(&sock->rbuf, sizeof(u8), MICRON_CONFIG_NET_RWBUF);
-    queue_init(&sock->wbuf, sizeof(u8), MICRON_CONFIG_NET_RWBUF);
-    queue_init(&sock->waiting_client, sizeof(uptr), 1);
 
     return sock;
 }
 
-static void netsock_push(struct netsock *sock)
+static void netsock_zc_push(struct netsock *sock)
+{
+    struct pbuf *seg;
+
+    /* Split the pending chain into single pbufs, and hand them over to the
+       user. pbuf_dechain drops the reference the head had on the rest of the
+       chain, so take our own first. No more than NET_ZC_SEGMENTS are out
+       at once, counting the ones the user holds and the ones waiting in
+       zc_release, so net_recv_release always finds room. */
+
+    while (sock->zc_pending && sock->zc_held < NET_ZC_SEGMENTS) {
+        seg = sock->zc_pending;
+        sock->zc_pending = seg->next;
+        if (sock->zc_pending)
+            pbuf_ref(sock->zc_pending);
+        pbuf_dechain(seg);
+
+        if (!seg->len) {
+            pbuf_free(seg);
+            continue;
+        }
+
+        ring_write(&sock->zc_rx, &seg, 1);
+        sock->zc_held++;
+        sock->net->netsock_rx += seg->len;
+        sock->rx_bytes += seg->len;
+    }
+
+    net_notify(sock->net);
+}
+
+static void netsock_zc_collect(struct netsock *sock)
+{
+    struct pbuf *seg;
+
+    /* Segments released by the user give their length back to the TCP
+       window, which also makes room for the pending ones. */
+
+    while (ring_read(&sock->zc_release, &seg, 1)) {
+        if (sock->tcp)
+            tcp_recved(sock->tcp, seg->len);
+        pbuf_free(seg);
+        sock->zc_held--;
+    }
+
+    netsock_zc_push(sock);
+}
+
+static void netsock_zc_drop(struct netsock *sock)
+{
+    struct pbuf *seg;
+
+    while (ring_read(&sock->zc_release, &seg, 1))
+        pbuf_free(seg);
+    while (ring_read(&sock->zc_rx, &seg, 1))
+        pbuf_free(seg);
+
+    if (sock->zc_pending)
+        pbuf_free(sock->zc_pending);
+    sock->zc_pending = NULL;
+}
+
+static u32 net_used_socks(struct net *net)
+{
+    return ~net->sock_free & (u32) ((1ull << MICRON_CONFIG_NET_MAXSOCK) - 1);
+}
+
+static void net_collect_all(struct net *net)
+{
+    struct netsock *sock;
+
+    for (u32 used = net_used_socks(net); used; used &= used - 1) {
+        sock = net->socks[__builtin_ctz(used)];
+        if (sock && sock->flags & NS_ZEROCOPY)
+            netsock_zc_collect(sock);
+    }
+}
+
+static void netsock_zc_complete(struct netsock *sock, bool all)
+{
+    struct net_zc_tx *tx;
+    u32 end;
+
+    /* Buffers are completed in order, once every byte of them has been
+       acknowledged. With all, everything goes, including buffers which were
+       never written - the connection is gone at this point. */
+
+    end = all ? sock->zc_tx.head : sock->zc_tx_next;
+
+    while (sock->zc_tx.tail != end) {
+        tx = ring_slot(&sock->zc_tx, sock->zc_tx.tail);
+        if (!all && (i32) (sock->tx_acked - tx->end) < 0)
+            break;
+        if (tx->done)
+            tx->done(tx->arg);
+        ring_consume(&sock->zc_tx, 1);
+    }
+
+    if (all) {
+        sock->zc_tx_next = sock->zc_tx.tail;
+        sock->zc_tx_offset = 0;
+    }
+
+    net_notify(sock->net);
+}
+
+static u32 netsock_push_wbuf(struct netsock *sock, u32 limit)
+{
+    u32 pushed;
+    u32 left;
+    u32 len;
+    void *data;
+
+    /* lwIP copies the data, so we can free the ring slots right away. */
+
+    left = imin(tcp_sndbuf(sock->tcp), limit);
+    pushed = 0;
+
+    while (left) {
+        data = ring_read_ptr(&sock->wbuf, &len);
+        len = imin(len, left);
+
+        if (tcp_write(sock->tcp, data, len, TCP_WRITE_FLAG_COPY))
+            break;
+
+        ring_consume(&sock->wbuf, len);
+        pushed += len;
+        left -= len;
+    }
+
+    sock->tx_written += pushed;
+    sock->net->netsock_tx += pushed;
+
+    return pushed;
+}
+
+static bool netsock_push_zc(struct netsock *sock, struct net_zc_tx *tx)
 {
     u32 len;
 
+    /* Without TCP_WRITE_FLAG_COPY, lwIP only references the buffer, so it has
+       to stay around until netsock_tcp_sent sees it acknowledged. */
+
+    while (sock->zc_tx_offset < tx->len) {
+        len = imin(tcp_sndbuf(sock->tcp), tx->len - sock->zc_tx_offset);
+        if (!len)
+            return false;
+        if (tcp_write(sock->tcp, tx->buf + sock->zc_tx_offset, len, 0))
+            return false;
+
+        sock->zc_tx_offset += len;
+        sock->tx_written += len;
+        sock->net->netsock_tx += len;
+    }
+
+    tx->end = sock->tx_written;
+    sock->zc_tx_offset = 0;
+
+    return true;
+}
+
+static u32 netsock_queued(struct netsock *sock)
+{
+    struct net_zc_tx *tx;
+    u32 queued;
+
+    /* Bytes waiting to be passed to tcp_write, in wbuf and zc_tx. */
+
+    queued = ring_level(&sock->wbuf);
+    for (u32 i = sock->zc_tx_next; i != sock->zc_tx.head; i++) {
+        tx = ring_slot(&sock->zc_tx, i);
+        queued += tx->len;
+    }
+
+    return queued - sock->zc_tx_offset;
+}
+
+static void netsock_push(struct netsock *sock)
+{
+    struct net_zc_tx *tx;
+    u16 xmit;
+    u32 before;
+
+    /* A corked socket only sends full segments, the rest waits for more data
+       or for net_flush. If the write buffer or the zero-copy ring is full,
+       there is no point in waiting, as the writer is blocked on it. */
+
+    if (sock->corked && ring_space(&sock->wbuf) && ring_space(&sock->zc_tx)
+        && netsock_queued(sock) < tcp_mss(sock->tcp))
+        return;
+
+    if (sock->flags & NS_NODELAY)
+        tcp_nagle_disable(sock->tcp);
+    else
+        tcp_nagle_enable(sock->tcp);
+
     /* Move data from the write buffer into the TCP/IP stack. Note that we
        cannot send more data that can fit into the TCP queue, so the rest
-       just stays our wbuf queue and blocks. */
+       just stays our wbuf and blocks. Zero-copy buffers are sent in between,
+       right after the wbuf bytes which were written before them. */
+
+    while (1) {
+        tx = NULL;
+        before = ring_level(&sock->wbuf);
+
+        if (sock->zc_tx_next != sock->zc_tx.head) {
+            __dmb();
+            tx = ring_slot(&sock->zc_tx, sock->zc_tx_next);
+            before = tx->wbuf_mark - sock->wbuf.tail;
+        }
+
+        if (before) {
+            if (netsock_push_wbuf(sock, before) < before)
+                break;
+            continue;
+        }
+
+        if (!tx || !netsock_push_zc(sock, tx))
+            break;
+
+        sock->zc_tx_next++;
+    }
+
+    /* tcp_write appends to the last unsent segment up to the MSS, so by
+       sending only once everything is queued, the data goes out in as few
+       segments as possible. lwIP counts every segment it sends. */
+
+    xmit = lwip_stats.tcp.xmit;
+    tcp_output(sock->tcp);
+    sock->net->tx_segments += (u16) (lwip_stats.tcp.xmit - xmit);
+
+    /* Wake up net_write if it's waiting for space. */
+    net_notify(sock->net);
+}
+
+static void netsock_response(struct netsock *sock)
+{
+    /* Count the data written since the last response as one response. */
+
+    if (sock->tx_written == sock->tx_response_mark)
+        return;
+
+    sock->tx_response_mark = sock->tx_written;
+    sock->net->tx_responses++;
+}
+
+static void netsock_udp_push(struct netsock *sock)
+{
+    struct net_dgram dgram;
+    struct pbuf *packet;
+
+    /* Each datagram is prefixed by its descriptor. Wait for the whole thing
+       to be in the ring, net_sendto may still be writing the payload. */
+
+    while (ring_peek(&sock->wbuf, &dgram, sizeof(dgram)) == sizeof(dgram)) {
+        if (ring_level(&sock->wbuf) < sizeof(dgram) + dgram.len)
+            break;
+
+        /* Out of pbufs, try again on the next iteration. */
+        if (!(packet = pbuf_alloc(PBUF_TRANSPORT, dgram.len, PBUF_RAM)))
+            break;
+
+        ring_consume(&sock->wbuf, sizeof(dgram));
+        ring_read(&sock->wbuf, packet->payload, dgram.len);
+
+        udp_sendto(sock->udp, packet, &dgram.addr, dgram.port);
+        pbuf_free(packet);
+
+        sock->net->netsock_tx += dgram.len;
+        sock->tx_written += dgram.len;
+    }
+
+    /* Wake up net_sendto if it's waiting for space. */
+    net_notify(sock->net);
+}
 
-    len = imin(tcp_sndbuf(sock->tcp), queue_get_level(&sock->wbuf));
+static void netsock_finish_close(struct net *net, struct netsock *sock)
+{
+    struct netsock *client;
+
+    net->socks[sock->id] = NULL;
+    net->sock_free |= 1 << sock->id;
+    netsock_response(sock);
+
+    /* Clients nobody has picked up yet go away with their listener. */
+
+    while (queue_try_remove(&sock->waiting_client, &client))
+        netsock_finish_close(net, client);
+
+    /* Detach the socket from the PCB first, lwIP may keep it around for a
+       while after tcp_close. */
+
+    if (sock->tcp) {
+        tcp_arg(sock->tcp, NULL);
+        tcp_err(sock->tcp, NULL);
+        if (sock->tcp->state != LISTEN) {
+            tcp_recv(sock->tcp, NULL);
+            tcp_sent(sock->tcp, NULL);
+        }
+
+        if (tcp_close(sock->tcp)) {
+            syslog(LOG_ERR "failed to tcp_close(%d)", sock->id);
+            tcp_abort(sock->tcp);
+        }
+    }
+
+    if (sock->udp) {
+        udp_recv(sock->udp, NULL, NULL);
+        udp_remove(sock->udp);
+    }
 
-    for (u32 i = 0; i < len; i++)
-        queue_remove_blocking(&sock->wbuf, &sock->tmpbuf[i]);
+    netsock_zc_complete(sock, true);
+    netsock_zc_drop(sock);
+    netsock_destroy(net, sock);
+}
 
-    tcp_write(sock->tcp, sock->tmpbuf, len, 0);
-    sock->net->netsock_tx += len;
+static bool netsock_drained(struct netsock *sock)
+{
+    return (!sock->tcp && !sock->udp)
+        || (ring_is_empty(&sock->wbuf) && ring_is_empty(&sock->zc_tx));
 }
 
 static void net_push_all(struct net *net)
 {
     struct netsock *sock;
 
-    /* Push all data in write buffers in open netsocks. */
+    /* Push all data in write buffers in open netsocks. Closed sockets stay
+       here until all of their data is sent, and the zero-copy buffers are
+       acknowledged. */
 
-    for (i32 i = 0; i < net->nsocks; i++) {
-        if (!net->socks[i])
+    for (u32 used = net_used_socks(net); used; used &= used - 1) {
+        sock = net->socks[__builtin_ctz(used)];
+
+        /* Closing a listener also closes the clients in its backlog, which
+           may come later in the bitmap we started with. */
+
+        if (!sock)
             continue;
-        sock = net->socks[i];
-        if (queue_get_level(&sock->wbuf))
+
+        /* Once the user has the client, it no longer counts against the
+           listen backlog. */
+
+        if (sock->backlogged && sock->accepted) {
+            if (sock->tcp)
+                tcp_backlog_accepted(sock->tcp);
+            sock->backlogged = false;
+        }
+
+        if (sock->tcp
+            && (!ring_is_empty(&sock->wbuf)
+                || sock->zc_tx_next != sock->zc_tx.head))
             netsock_push(sock);
+
+        if (sock->flushes != sock->flushes_seen) {
+            sock->flushes_seen = sock->flushes;
+            netsock_response(sock);
+        }
+        if (sock->udp && !ring_is_empty(&sock->wbuf))
+            netsock_udp_push(sock);
+
+        if (sock->closing && netsock_drained(sock))
+            netsock_finish_close(net, sock);
     }
 }
 
 static i32 netsock_close(struct net *net, struct netsock *sock)
 {
-    /* Remove the socket from the netsock list. */
+    /* The data left in the write buffers is sent by net_push_all, which
+       then finishes closing the socket. */
 
-    for (i32 i = 0; i < net->nsocks; i++) {
-        if (net->socks[i] == sock)
-            net->socks[i] = NULL;
-    }
-
-    /* Send any data we have left. */
-
-    while (!queue_is_empty(&sock->wbuf))
+    sock->closing = true;
+    if (sock->tcp && !netsock_drained(sock))
         netsock_push(sock);
+    if (sock->udp && !netsock_drained(sock))
+        netsock_udp_push(sock);
 
-    if (tcp_close(sock->tcp)) {
-        syslog(LOG_ERR "failed to tcp_close(%d)", sock->id);
-        return 1;
-    }
-
-    queue_free(&sock->rbuf);
-    queue_free(&sock->wbuf);
-    queue_free(&sock->waiting_client);
-    free(sock->tmpbuf);
-    free(sock);
+    if (netsock_drained(sock))
+        netsock_finish_close(net, sock);
 
     return 0;
 }
 
+static i8 netsock_tcp_sent(struct netsock *sock, struct tcp_pcb *__unused tcp,
+                           u16 len)
+{
+    sock->tx_acked += len;
+    netsock_zc_complete(sock, false);
+
+    return ERR_OK;
+}
+
 static i8 netsock_tcp_recv(struct netsock *sock, struct tcp_pcb *__unused tcp,
                            struct pbuf *packet, i8 __unused err)
 {
-    u32 to_read;
+    u32 total;
+    u32 len;
+    void *dest;
 
     if (!packet) {
         sock->connected = false;
+        net_notify(sock->net);
         return 0;
     }
 
+    /* In zero-copy mode we keep the whole packet, and only open the window
+       once the user releases the segments. The window is what stops the
+       pending chain from growing without bounds. */
+
+    if (sock->flags & NS_ZEROCOPY) {
+        if (sock->zc_pending)
+            pbuf_cat(sock->zc_pending, packet);
+        else
+            sock->zc_pending = packet;
+
+        netsock_zc_push(sock);
+        return ERR_OK;
+    }
+
     /* Because we have a limited amount of space in the read buffer, we can only
        read so many bytes. If we don't consume the whole packet at once, store
        the offset in the netsock and return INPROGRESS to notify lwip about our
-       intention to read the packet again later. */
+       intention to read the packet again later. The data is copied straight
+       from the pbuf chain into the ring. */
+
+    total = 0;
+
+    while (sock->packet_read_offset < packet->tot_len) {
+        dest = ring_write_ptr(&sock->rbuf, &len);
+        if (!len)
+            break;
+
+        len = imin(len, packet->tot_len - sock->packet_read_offset);
+        pbuf_copy_partial(packet, dest, len, sock->packet_read_offset);
+        ring_commit(&sock->rbuf, len);
 
-    to_read = imin(packet->len - sock->packet_read_offset,
-                   sock->rbuf.element_count - queue_get_level(&sock->rbuf));
-    pbuf_copy_partial(packet, sock->tmpbuf, to_read, sock->packet_read_offset);
-    tcp_recved(tcp, to_read);
-    sock->net->netsock_rx += to_read;
+        sock->packet_read_offset += len;
+        total += len;
+    }
 
-    for (u32 i = 0; i < to_read; i++)
-        queue_add_blocking(&sock->rbuf, &((u8 *) sock->tmpbuf)[i]);
+    tcp_recved(tcp, total);
+    sock->net->netsock_rx += total;
+    sock->rx_bytes += total;
+    net_notify(sock->net);
 
     /* Once we read the whole packet, free it and return OK. */
 
-    if (packet->len == to_read + sock->packet_read_offset) {
+    if (sock->packet_read_offset == packet->tot_len) {
         sock->packet_read_offset = 0;
         pbuf_free(packet);
         return ERR_OK;
     }
 
-    sock->packet_read_offset += to_read;
-
     return ERR_INPROGRESS;
 }
 
+static void netsock_udp_recv(struct netsock *sock, struct udp_pcb *__unused udp,
+                             struct pbuf *packet, const ip_addr_t *addr,
+                             u16 port)
+{
+    struct net_dgram dgram;
+    u32 copied;
+    u32 len;
+    void *dest;
+
+    /* Datagrams are never split, if there is no space for the whole thing
+       (or for its descriptor) it's dropped, like a full socket buffer
+       would. */
+
+    if (!ring_space(&sock->dgrams) || ring_space(&sock->rbuf) < packet->tot_len)
+        goto drop;
+
+    for (copied = 0; copied < packet->tot_len; copied += len) {
+        dest = ring_write_ptr(&sock->rbuf, &len);
+        len = imin(len, packet->tot_len - copied);
+        pbuf_copy_partial(packet, dest, len, copied);
+        ring_commit(&sock->rbuf, len);
+    }
+
+    dgram.addr = *addr;
+    dgram.port = port;
+    dgram.len = packet->tot_len;
+    ring_write(&sock->dgrams, &dgram, 1);
+
+    sock->net->netsock_rx += dgram.len;
+    sock->rx_bytes += dgram.len;
+    net_notify(sock->net);
+    pbuf_free(packet);
+    return;
+
+drop:
+    sock->net->rx_drops++;
+    sock->rx_drops++;
+    pbuf_free(packet);
+}
+
 static i8 netsock_tcp_connected(struct netsock *__unused sock,
                                 struct tcp_pcb *tcp, i8 __unused err)
 {
@@ -214,21 +752,35 @@ static i8 netsock_tcp_connected(struct netsock *__unused sock,
     return 0;
 }
 
-static void netsock_tcp_err(struct netsock *__unused sock, i8 err)
+static void netsock_tcp_err(struct netsock *sock, i8 err)
 {
     syslog("netsock_tcp: TCP/IP failure (%d)", err);
+
+    /* lwIP has already freed the PCB, so there is nothing left to send the
+       data with. Complete everything and wake up the user. */
+
+    sock->tcp = NULL;
+    sock->connected = false;
+    netsock_zc_complete(sock, true);
+    net_notify(sock->net);
 }
 
 static i32 net_add_sock(struct net *net, struct netsock *sock)
 {
-    for (i32 i = 0; i < net->nsocks; i++) {
-        if (net->socks[i])
-            continue;
-        net->socks[i] = sock;
-        return 0;
-    }
+    u32 id;
 
-    return 1;
+    /* The netsock ID is its slot in the table, picked from the free bitmap
+       so that closed slots are reused right away. */
+
+    if (!net->sock_free)
+        return 1;
+
+    id = __builtin_ctz(net->sock_free);
+    net->sock_free &= ~(1 << id);
+    net->socks[id] = sock;
+    sock->id = id;
+
+    return 0;
 }
 
 static i8 netsock_tcp_accept(struct netsock *sock, struct tcp_pcb *tcp_client,
@@ -244,58 +796,88 @@ static i8 netsock_tcp_accept(struct netsock *sock, struct tcp_pcb *tcp_client,
     if (!tcp_client)
         return 0;
 
-    /* Accept the connection only if the netsock is waiting for a client,
-       otherwise drop it. */
+    /* Connections are queued until net_accept picks them up. Once the queue
+       is full, tcp_backlog_delayed makes lwIP ignore new SYNs instead of
+       resetting them, so the clients retry a little later. */
 
-    if (!sock->waiting_for_client) {
-        tcp_close(tcp_client);
-        return ERR_CLSD;
+    if (queue_is_full(&sock->waiting_client)) {
+        sock->net->accept_drops++;
+        tcp_abort(tcp_client);
+        return ERR_ABRT;
     }
 
-    /* Drop anything that isn't from the LAN network. */
-
-    if (!netfilter_lan_addr(&tcp_client->remote_ip)) {
-        tcp_close(tcp_client);
-        return ERR_CLSD;
+    /* Create the new client netsock, and return it to the user by pushing
+       it onto the waiting_client queue. If we don't have space for the
+       connection, abort it. */
+
+    if (!(client = netsock_create(sock->net))) {
+        syslog(LOG_ERR "no memory for new netsock");
+        sock->net->accept_drops++;
+        tcp_abort(tcp_client);
+        return ERR_ABRT;
     }
 
-    /* Create the new client netsock, and return it to the user by pushing
-       it onto the waiting_client queue. */
+    if (net_add_sock(sock->net, client)) {
+        syslog(LOG_ERR "no space for new netsock");
+        netsock_destroy(sock->net, client);
+        sock->net->accept_drops++;
+        tcp_abort(tcp_client);
+        return ERR_ABRT;
+    }
 
-    client = netsock_create(sock->net);
     client->addr.addr = tcp_client->remote_ip.addr;
     client->port = tcp_client->remote_port;
     client->tcp = tcp_client;
     client->connected = true;
+    client->flags = sock->flags;
+    client->backlogged = true;
 
     tcp_arg(tcp_client, client);
     tcp_err(tcp_client, (tcp_err_fn) netsock_tcp_err);
     tcp_recv(tcp_client, (tcp_recv_fn) netsock_tcp_recv);
+    tcp_sent(tcp_client, (tcp_sent_fn) netsock_tcp_sent);
+    tcp_backlog_delayed(tcp_client);
 
-    /* If we don't have space for the connection, abort it. */
-
-    if (net_add_sock(sock->net, client)) {
-        syslog(LOG_ERR "no space for new netsock");
-        tcp_close(tcp_client);
-        return ERR_CLSD;
-    }
-
-    sock->waiting_for_client = false;
     queue_add_blocking(&sock->waiting_client, &client);
+    sock->net->accepts++;
+    net_notify(sock->net);
 
     return 0;
 }
 
-static void netctrl_socket(struct net *net)
+static i8 netsock_listen(struct netsock *sock)
+{
+    i8 err;
+
+    err = tcp_bind(sock->tcp, &sock->addr, sock->port);
+    if (err)
+        syslog("netsock_tcp: bind failed (%d)", err);
+
+    sock->tcp = tcp_listen_with_backlog_and_err(
+        sock->tcp, MICRON_CONFIG_NET_BACKLOG, &err);
+    if (!sock->tcp)
+        syslog("netsock_tcp: listen failed (%d)", err);
+
+    sock->listening = true;
+
+    syslog("netctrl: bind+listen %s:%d", ipaddr_ntoa(&sock->addr), sock->port);
+
+    tcp_arg(sock->tcp, sock);
+    tcp_accept(sock->tcp, (tcp_accept_fn) netsock_tcp_accept);
+
+    return err;
+}
+
+static iptr netctrl_socket(struct net *net, struct netctrl_req *__unused req)
 {
     struct netsock *sock;
-    uptr nullptr;
 
     /* socket() -> sock */
 
     /* Create the netsock structure. */
 
-    sock = netsock_create(net);
+    if (!(sock = netsock_create(net)))
+        return 0;
 
     /* Create the TCP control block. */
 
@@ -305,6 +887,7 @@ static void netctrl_socket(struct net *net)
     tcp_arg(sock->tcp, sock);
     tcp_err(sock->tcp, (tcp_err_fn) netsock_tcp_err);
     tcp_recv(sock->tcp, (tcp_recv_fn) netsock_tcp_recv);
+    tcp_sent(sock->tcp, (tcp_sent_fn) netsock_tcp_sent);
 
     /* Save the netsock in the socket list, so we can access it later,
        and send it to the user. */
@@ -314,31 +897,65 @@ static void netctrl_socket(struct net *net)
         goto err;
     }
 
-    queue_add_blocking(&net->ctrlres, &sock);
-
-    return;
+    return (iptr) sock;
 
 err:
-    queue_free(&sock->rbuf);
-    queue_free(&sock->wbuf);
-    net->last_netsock_id--;
-    free(sock->tmpbuf);
-    free(sock);
+    /* The PCB was never used, so tcp_close just frees it. */
+
+    if (sock->tcp) {
+        tcp_arg(sock->tcp, NULL);
+        tcp_err(sock->tcp, NULL);
+        tcp_close(sock->tcp);
+    }
+    netsock_destroy(net, sock);
+    return 0;
+}
+
+static iptr netctrl_udp(struct net *net, struct netctrl_req *__unused req)
+{
+    struct netsock *sock;
+
+    /* socket_udp() -> sock */
+
+    if (!(sock = netsock_create(net)))
+        return 0;
+
+    if (!(sock->udp = udp_new_ip_type(IPADDR_TYPE_V4)))
+        goto err;
+
+    udp_recv(sock->udp, (udp_recv_fn) netsock_udp_recv, sock);
+
+    /* There is no connection, the socket can send from the start. */
+    sock->connected = true;
+
+    if (net_add_sock(net, sock)) {
+        syslog(LOG_ERR "no space for netsock");
+        goto err;
+    }
 
-    nullptr = 0;
-    queue_add_blocking(&net->ctrlres, &nullptr);
+    return (iptr) sock;
+
+err:
+    if (sock->udp)
+        udp_remove(sock->udp);
+    netsock_destroy(net, sock);
+    return 0;
 }
 
-static void netctrl_connect(struct net *net)
+static iptr netctrl_connect(struct net *__unused net, struct netctrl_req *req)
 {
     struct netsock *sock;
-    iptr err;
+    i8 err;
 
     /* connect(sock, ip, port) -> err */
 
-    queue_remove_blocking(&net->netctrl, &sock);
-    queue_remove_blocking(&net->netctrl, &sock->addr.addr);
-    queue_remove_blocking(&net->netctrl, &sock->port);
+    sock = (struct netsock *) req->args[0];
+    sock->addr.addr = req->args[1];
+    sock->port = req->args[2];
+
+    /* For UDP this only sets the default peer. */
+    if (sock->udp)
+        return udp_connect(sock->udp, &sock->addr, sock->port);
 
     err = tcp_connect(sock->tcp, &sock->addr, sock->port,
                       (tcp_connected_fn) netsock_tcp_connected);
@@ -346,148 +963,363 @@ static void netctrl_connect(struct net *net)
         syslog("netsock_tcp: connect failed (%d)", err);
 
     sock->connected = true;
-    queue_add_blocking(&net->ctrlres, &err);
+    return err;
 }
 
-static void netctrl_bind(struct net *net)
+static iptr netctrl_bind(struct net *__unused net, struct netctrl_req *req)
 {
     struct netsock *sock;
-    iptr nerr;
     i8 err;
 
     /* bind(sock, ip, port) -> err */
 
-    queue_remove_blocking(&net->netctrl, &sock);
-    queue_remove_blocking(&net->netctrl, &sock->addr.addr);
-    queue_remove_blocking(&net->netctrl, &sock->port);
+    sock = (struct netsock *) req->args[0];
+    sock->addr.addr = req->args[1];
+    sock->port = req->args[2];
 
-    err = tcp_bind(sock->tcp, &sock->addr, sock->port);
-    if (err)
-        syslog("netsock_tcp: bind failed (%d)", err);
+    if (sock->udp) {
+        err = udp_bind(sock->udp, &sock->addr, sock->port);
+        if (err)
+            syslog("netsock_udp: bind failed (%d)", err);
+        return err;
+    }
 
-    sock->tcp = tcp_listen_with_backlog_and_err(sock->tcp, 2, &err);
-    if (!sock->tcp)
-        syslog("netsock_tcp: listen failed (%d)", err);
+    return netsock_listen(sock);
+}
 
-    syslog("netctrl: bind+listen %s:%d", ipaddr_ntoa(&sock->addr), sock->port);
+static iptr netctrl_close(struct net *net, struct netctrl_req *req)
+{
+    /* close(sock) -> i32 */
 
-    tcp_arg(sock->tcp, sock);
-    tcp_accept(sock->tcp, (tcp_accept_fn) netsock_tcp_accept);
+    return netsock_close(net, (struct netsock *) req->args[0]);
+}
+
+static iptr netctrl_run(struct net *net, struct netctrl_req *req)
+{
+    switch (req->cmd) {
+    case NC_SOCKET:
+        return netctrl_socket(net, req);
+    case NC_CONNECT:
+        return netctrl_connect(net, req);
+    case NC_BIND:
+        return netctrl_bind(net, req);
+    case NC_CLOSE:
+        return netctrl_close(net, req);
+    case NC_UDP:
+        return netctrl_udp(net, req);
+    }
 
-    nerr = err;
-    queue_add_blocking(&net->ctrlres, &nerr);
+    return EINVAL;
 }
 
-static void netctrl_accept(struct net *net)
+static void collect_netctrl(struct net *net)
 {
-    struct netsock *server;
+    struct netctrl_req **reqs;
+    struct netctrl_req *req;
+    u32 n;
+
+    /* Run every queued command in one go. The caller may reuse the request as
+       soon as it sees done, so that has to be the very last thing we touch. */
+
+    while ((reqs = ring_read_ptr(&net->ctrl, &n)) && n) {
+        for (u32 i = 0; i < n; i++) {
+            req = reqs[i];
+            req->res = netctrl_run(net, req);
+
+            if (req->cb)
+                req->cb(req);
+
+            __dmb();
+            req->done = true;
+        }
 
-    /* accept(sock) -> sock */
+        ring_consume(&net->ctrl, n);
+        net_notify(net);
+    }
+}
+
+_Static_assert(MICRON_CONFIG_NET_MAXSOCK <= 32,
+               "NET_MAXSOCK has to fit in the sock_free bitmap");
+_Static_assert(!(MICRON_CONFIG_NET_RWBUF & (MICRON_CONFIG_NET_RWBUF - 1)),
+               "NET_RWBUF has to be a power of two");
+
+struct net __micron_net;
+
+static u32 net_link_outage(struct net *net)
+{
+    /* Length of the current outage in ms, 0 while the link is up. */
 
-    queue_remove_blocking(&net->netctrl, &server);
-    server->waiting_for_client = true;
+    if (net->link_state == NET_LINK_UP)
+        return 0;
 
-    /* We don't wait for the client connection here, because we have other
-       important things to do - return the client once it actually has
-       connected, blocking the main thread until something happens. */
+    return absolute_time_diff_us(net->link_lost_at, get_absolute_time())
+         / 1000;
 }
 
-static void netctrl_stat(struct net *net)
+static void net_publish_stats(struct net *net)
 {
-    i32 value;
+    struct net_sock_stats *ss;
+    struct net_stats *stats;
+    struct netsock *sock;
 
-    queue_remove_blocking(&net->netctrl, &value);
-    switch (value) {
-    case NCSTAT_RX:
-        queue_add_blocking(&net->ctrlres, &net->netsock_rx);
-        break;
-    case NCSTAT_TX:
-        queue_add_blocking(&net->ctrlres, &net->netsock_tx);
-        break;
+    /* Only core 1 writes the stats, so a sequence count is enough: an odd
+       value tells the readers to wait, and a changed one to read again. */
+
+    stats = &net->stats;
+    net->stats_seq++;
+    __dmb();
+
+    stats->rx_bytes = net->netsock_rx;
+    stats->tx_bytes = net->netsock_tx;
+    stats->tx_segments = net->tx_segments;
+    stats->tx_responses = net->tx_responses;
+    stats->accepts = net->accepts;
+    stats->accept_drops = net->accept_drops;
+    stats->rx_drops = net->rx_drops;
+    stats->icmp_replies = net->icmp_replies;
+    stats->icmp_limited = net->icmp_limited;
+    stats->icmp_drops = net->icmp_drops;
+    stats->doorbell_avg_us = net->doorbell_count
+                               ? net->doorbell_total_us / net->doorbell_count
+                               : 0;
+    stats->doorbell_max_us = net->doorbell_max_us;
+    stats->link_xmit = lwip_stats.link.xmit;
+    stats->link_recv = lwip_stats.link.recv;
+    stats->link_drop = lwip_stats.link.drop;
+    stats->link_err = lwip_stats.link.err;
+    stats->lwip_mem_used = lwip_stats.mem.used;
+    stats->lwip_mem_max = lwip_stats.mem.max;
+    stats->lwip_mem_err = lwip_stats.mem.err;
+    stats->link_up = net->link_state == NET_LINK_UP;
+    stats->link_outages = net->link_outages;
+    stats->link_outage_ms = net->link_outage_ms + net_link_outage(net);
+    stats->link_outage_max_ms = net->link_outage_max_ms;
+    stats->wifi_ip_ms = net->w_ip_ms;
+    stats->wifi_fast_join = net->w_fast_join;
+    stats->nsocks = 0;
+
+    for (u32 used = net_used_socks(net); used; used &= used - 1) {
+        sock = net->socks[__builtin_ctz(used)];
+        ss = &stats->socks[stats->nsocks++];
+
+        ss->id = sock->id;
+        ss->proto = sock->udp ? IP_PROTO_UDP : IP_PROTO_TCP;
+        ss->rbuf_level = ring_level(&sock->rbuf);
+        ss->wbuf_level = ring_level(&sock->wbuf);
+        ss->backlog = queue_get_level(&sock->waiting_client);
+        ss->rx_bytes = sock->rx_bytes;
+        ss->tx_bytes = sock->tx_written;
+        ss->rx_drops = sock->rx_drops;
     }
+
+    __dmb();
+    net->stats_seq++;
 }
 
-static void netctrl_close(struct net *net)
+static void net_link_lost(struct net *net, i32 link)
 {
     struct netsock *sock;
-    i32 res;
 
-    queue_remove_blocking(&net->netctrl, &sock);
-    res = netsock_close(net, sock);
-    queue_add_blocking(&net->ctrlres, &res);
+    syslog(LOG_ERR "%s: link lost (%d)", net->backend->name, link);
+
+    /* The connections won't survive a new association (and maybe a new
+       address), so end them now instead of letting them time out. The
+       sockets stay in the table, the user sees EPIPE and closes them. */
+
+    for (u32 used = net_used_socks(net); used; used &= used - 1) {
+        sock = net->socks[__builtin_ctz(used)];
+        if (!sock->tcp || sock->listening)
+            continue;
+
+        sock->error = EPIPE;
+        tcp_abort(sock->tcp);
+    }
+
+    net->link_state = NET_LINK_DOWN;
+    net->link_lost_at = get_absolute_time();
+    net->link_backoff_ms = NET_RECONNECT_MIN_MS;
+    net->link_next = make_timeout_time_ms(net->link_backoff_ms);
+    net->link_attempts = 0;
+    net->link_outages++;
 }
 
-static void collect_netctrl(struct net *net)
+static void net_link_rearm(struct net *net, struct netsock *sock)
 {
-    u32 cmd;
+    ip_addr_t *addr;
+
+    /* Sockets bound to the old address would never see another packet if
+       DHCP gave us a new one, so move them over. A listening PCB can't be
+       bound again, it has to be replaced. */
+
+    addr = &net->iface->ip_addr;
 
-    if (queue_is_empty(&net->netctrl))
+    if (sock->udp) {
+        if (ip_addr_isany(&sock->udp->local_ip)
+            || ip_addr_cmp(&sock->udp->local_ip, addr))
+            return;
+
+        syslog("netsock: moving :%d to %s", sock->udp->local_port,
+               ipaddr_ntoa(addr));
+        udp_bind(sock->udp, addr, sock->udp->local_port);
         return;
+    }
 
-    queue_remove_blocking(&net->netctrl, &cmd);
-    switch (cmd) {
-    case NC_SOCKET:
-        netctrl_socket(net);
-        break;
-    case NC_CONNECT:
-        netctrl_connect(net);
-        break;
-    case NC_BIND:
-        netctrl_bind(net);
-        break;
-    case NC_ACCEPT:
-        netctrl_accept(net);
+    if (ip_addr_isany(&sock->addr) || ip_addr_cmp(&sock->addr, addr))
+        return;
+
+    syslog("netsock: moving :%d to %s", sock->port, ipaddr_ntoa(addr));
+
+    tcp_arg(sock->tcp, NULL);
+    tcp_accept(sock->tcp, NULL);
+    tcp_close(sock->tcp);
+
+    sock->addr = *addr;
+
+    if (!(sock->tcp = tcp_new_ip_type(IPADDR_TYPE_V4))) {
+        syslog(LOG_ERR "no memory to listen on :%d", sock->port);
+        sock->error = ENOMEM;
+        sock->listening = false;
+        __dmb();
+        net_notify(net);
+        return;
+    }
+
+    netsock_listen(sock);
+}
+
+static void net_link_restored(struct net *net)
+{
+    struct netsock *sock;
+    u32 outage;
+
+    outage = net_link_outage(net);
+    net->link_outage_ms += outage;
+    if (outage > net->link_outage_max_ms)
+        net->link_outage_max_ms = outage;
+
+    syslog("%s: link back after %ums, ip %s", net->backend->name, outage,
+           ipaddr_ntoa(&net->iface->ip_addr));
+
+    for (u32 used = net_used_socks(net); used; used &= used - 1) {
+        sock = net->socks[__builtin_ctz(used)];
+        if ((sock->listening && sock->tcp) || sock->udp)
+            net_link_rearm(net, sock);
+    }
+
+    net->link_state = NET_LINK_UP;
+}
+
+static void net_link_check(struct net *net)
+{
+    i32 link;
+
+    /* Instead of giving up on a lost link, keep trying to get it back,
+       waiting twice as long after each failed attempt. The sockets and
+       netctrl keep working in the meantime. */
+
+    link = net->backend->link(net);
+
+    switch (net->link_state) {
+    case NET_LINK_UP:
+        if (link <= 0)
+            net_link_lost(net, link);
         break;
-    case NC_STAT:
-        netctrl_stat(net);
+
+    case NET_LINK_DOWN:
+        if (link > 0) {
+            net_link_restored(net);
+            break;
+        }
+
+        if (!net->backend->reconnect || !time_reached(net->link_next))
+            break;
+
+        syslog("%s: reconnecting (attempt %u)", net->backend->name,
+               net->link_attempts + 1);
+        net->backend->reconnect(net, net->link_attempts++);
+        net->link_state = NET_LINK_JOINING;
+        net->link_next = make_timeout_time_ms(NET_JOIN_TIMEOUT_MS);
         break;
-    case NC_CLOSE:
-        netctrl_close(net);
+
+    case NET_LINK_JOINING:
+        if (link > 0) {
+            net_link_restored(net);
+            break;
+        }
+
+        if (link >= 0 && !time_reached(net->link_next))
+            break;
+
+        net->link_backoff_ms = imin(net->link_backoff_ms * 2,
+                                    NET_RECONNECT_MAX_MS);
+        net->link_state = NET_LINK_DOWN;
+        net->link_next = make_timeout_time_ms(net->link_backoff_ms);
+
+        syslog(LOG_WARN "%s: reconnect failed (%d), next in %ums",
+               net->backend->name, link, net->link_backoff_ms);
         break;
     }
 }
 
-struct net __micron_net;
-
 static void net_thread()
 {
     struct net *net;
     usize heap_free;
-    i32 link;
-    i32 rssi;
+    u32 sleep_ms;
+    u32 rung_at;
+    bool rung;
 
     net = &__micron_net;
 
     icmp_serve(net);
 
-    /* Continuously poll for events on the network interface, because we should
-       be running on the other core. Apart from working the IP stack, collect
-       netctrl commands, and move data from the queues onto the TCP/IP stack. */
+    /* Wait for events on the network interface, because we should be running
+       on the other core. Apart from working the IP stack, collect netctrl
+       commands, and move data from the queues onto the TCP/IP stack. */
 
     while (1) {
-        link = cyw43_wifi_link_status(&cyw43_state, CYW43_ITF_STA);
-        if (link < 0) {
-            syslog(LOG_ERR "wifi: link changed: %d", link);
-            break;
-        }
-
-        /* WARNING: this line is very important - it seems like it isn't doing
-           much, but not checking the connection RSSI will end up stopping all
-           network traffic from reaching interface. :( */
-        cyw43_wifi_get_rssi(&cyw43_state, &rssi);
-        cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, true);
+        net_link_check(net);
 
         heap_free = malloc_heap_free_left();
         if (heap_free < 16384)
             syslog(LOG_WARN "low heap memory: %d kB", heap_free >> 10);
+        stack_report();
+
+        /* Clear the doorbell before looking at the rings, so anything queued
+           from now on rings it again. The barrier after clearing it keeps
+           the ring reads from happening before the store. */
+
+        rung_at = 0;
+        rung = net->doorbell_rung;
+        if (rung) {
+            __dmb();
+            rung_at = net->doorbell_at;
+            net->doorbell_rung = false;
+            __dmb();
+        }
 
         collect_netctrl(net);
+        net_collect_all(net);
         net_push_all(net);
-        cyw43_arch_poll();
-        cyw43_arch_wait_for_work_until(make_timeout_time_ms(50));
-    }
 
-    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, false);
+        /* This only covers getting the work to lwIP: tcp_output may still
+           hold segments back for the window or Nagle, and the link output
+           queues frames for the radio. */
+
+        if (rung)
+            net_doorbell_add(net, time_us_32() - rung_at);
+        net_publish_stats(net);
+
+        net->backend->poll(net);
+
+        /* Sleep until the interface, an lwIP timer or the doorbell has some
+           work for us. The cap is only there for the link checks above. */
+
+        sleep_ms = sys_timeouts_sleeptime();
+        if (sleep_ms > NET_IDLE_MS)
+            sleep_ms = NET_IDLE_MS;
+        net->backend->wait(net, make_timeout_time_ms(sleep_ms));
+    }
 }
 
 i32 net_init()
@@ -497,25 +1329,36 @@ i32 net_init()
     if (!MICRON_CONFIG_NET)
         return 0;
 
-    /* Initialize the network stack, and connect to Wi-Fi. */
+    /* Initialize the network stack, and bring up the interface. */
 
     net = &__micron_net;
     memset(net, 0, sizeof(*net));
 
-    net->last_netsock_id = 0;
-    net->nsocks = 3;
-    queue_init(&net->netctrl, sizeof(uptr), 32);
-    queue_init(&net->ctrlres, sizeof(uptr), 32);
-
-    if (MICRON_CONFIG_NET_WIFI)
-        wifi_init(net);
+    net->sock_free = (u32) ((1ull << MICRON_CONFIG_NET_MAXSOCK) - 1);
+    net->sock_cache = mem_cache_create("netsock", sizeof(struct netsock), 0);
+    net->rwbuf_cache = mem_cache_create("netsock_rwbuf",
+                                        MICRON_CONFIG_NET_RWBUF, sizeof(u32));
+    net->ctrl_lock = spin_lock_init(spin_lock_claim_unused(true));
+    ring_init(&net->ctrl, net->ctrl_data, NET_CTRL_RING,
+              sizeof(struct netctrl_req *));
+
+#if PICO_ON_DEVICE
+    net->backend = &net_cyw43_backend;
+#else
+    net->backend = &net_loopback_backend;
+#endif
+
+    net->backend->init(net);
+    if (!net->iface)
+        return ENOENT;
 
-    /* Run the network stuff on the other core. */
+    /* Run the network stuff on the other core. Paint its stack first, so
+       stack_high_water(1) shows how much the lwIP callbacks need. */
 
-    if (net->iface)
-        multicore_launch_core1(net_thread);
-    else
-        return ENOENT;
+#if PICO_ON_DEVICE
+    stack_paint(1);
+#endif
+    net->backend->start(net, net_thread);
 
     return 0;
 }
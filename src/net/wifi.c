@@ -1,80 +1,177 @@
 /* wifi.c - Wi-Fi operations
    Copyright (c) 2024 bellrise */
 
+#include <lwip/prot/dhcp.h>
 #include <micron/buildconfig.h>
 #include <micron/errno.h>
 #include <micron/syslog.h>
 #include <micron/wifi.h>
-#include <pico/cyw43_arch.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
-static int wifi_scan_callback(struct net *net,
-                              const cyw43_ev_scan_result_t *result)
+#define WIFI_CACHE_MAGIC 0x57494631 /* "WIF1" */
+
+/* Address from the cached lease, in network order. */
+static u32 wifi_dhcp_addr;
+
+static u32 wifi_cache_sum(const struct wifi_cache *cache)
 {
-    char mac[32];
+    const u8 *bytes;
+    u32 sum;
 
-    if (!result)
-        return 0;
+    /* The sector is erased before it's written, so a write cut short leaves
+       0xff where the rest of the cache should be. */
 
-    syslog("Found ssid '%s'", result->ssid, mac);
+    bytes = (const u8 *) cache;
+    sum = 0;
 
-    if (!strcmp((const char *) result->ssid, net->w_ssid))
-        net->w_found_networks++;
+    for (u32 i = 0; i < offsetof(struct wifi_cache, sum); i++)
+        sum = (sum << 5) + sum + bytes[i];
 
-    return 0;
+    return sum;
 }
 
-i32 wifi_connect(struct net *net)
+static bool wifi_cache_valid(struct net *net, struct wifi_cache *cache)
+{
+    if (!MICRON_CONFIG_NET_WIFI_CACHE || net->w_radio->load(cache))
+        return false;
+
+    return cache->magic == WIFI_CACHE_MAGIC
+        && cache->sum == wifi_cache_sum(cache)
+        && !strncmp(cache->ssid, net->w_ssid, sizeof(cache->ssid));
+}
+
+static void wifi_cache_update(struct net *net, struct wifi_cache *cache)
+{
+    struct wifi_cache new;
+
+    /* Flash wears out, so only write if something changed. */
+
+    memset(&new, 0, sizeof(new));
+    new.magic = WIFI_CACHE_MAGIC;
+    strncpy(new.ssid, net->w_ssid, sizeof(new.ssid) - 1);
+    memcpy(new.bssid, net->w_bssid.addr, sizeof(new.bssid));
+    new.channel = net->w_channel;
+    new.addr = net->iface->ip_addr.addr;
+    new.sum = wifi_cache_sum(&new);
+
+    if (!MICRON_CONFIG_NET_WIFI_CACHE || !memcmp(&new, cache, sizeof(new)))
+        return;
+
+    net->w_radio->save(&new);
+}
+
+static i32 wifi_join(struct net *net, const u8 *bssid, u16 channel,
+                     u32 timeout_ms)
 {
-    cyw43_wifi_scan_options_t scan_opts;
+    const struct wifi_radio *radio;
+    absolute_time_t deadline;
+    i32 status;
     i32 err;
 
-    cyw43_arch_enable_sta_mode();
+    radio = net->w_radio;
+    deadline = make_timeout_time_ms(timeout_ms);
 
-    /* Scan only matching SSIDs. */
+    if ((err = radio->join(net, bssid, channel)))
+        return err;
 
-    memset(&scan_opts, 0, sizeof(scan_opts));
-    strcpy((char *) scan_opts.ssid, net->w_ssid);
+    /* The radio says it's up once DHCP has given us an address, which is
+       what everything else is waiting for. */
 
-    syslog("Scanning for Wi-Fi networks");
+    while ((status = radio->status(net)) != WIFI_UP) {
+        if (status < 0) {
+            radio->leave(net);
+            return -status;
+        }
 
-    err = cyw43_wifi_scan(&cyw43_state, &scan_opts, net,
-                          (void *) wifi_scan_callback);
-    if (err) {
-        syslog(LOG_ERR "Failed to start scan (err=%d)", err);
-        return 1;
+        if (absolute_time_diff_us(get_absolute_time(), deadline) <= 0) {
+            radio->leave(net);
+            return EAGAIN;
+        }
+
+        radio->wait(net, deadline);
     }
 
-    /* Wait until the scan has finished. */
+    if (bssid)
+        memcpy(net->w_bssid.addr, bssid, sizeof(net->w_bssid.addr));
+    net->w_channel = channel;
 
-    while (1) {
-        if (!cyw43_wifi_scan_active(&cyw43_state))
-            break;
-        cyw43_arch_poll();
-        cyw43_arch_wait_for_work_until(make_timeout_time_ms(1000));
+    return 0;
+}
+
+i32 wifi_connect(struct net *net)
+{
+    struct wifi_cache cache;
+    struct wifi_scan best;
+    i32 err;
+
+    /* Try the access point from the last boot first, joining it directly
+       skips the scan and the probing on every channel. */
+
+    memset(&cache, 0, sizeof(cache));
+    net->w_fast_join = false;
+
+    if (wifi_cache_valid(net, &cache)) {
+        syslog("Joining %s on channel %u", net->w_ssid, cache.channel);
+        wifi_dhcp_addr = cache.addr;
+
+        err = wifi_join(net, cache.bssid, cache.channel, WIFI_FAST_TIMEOUT_MS);
+        if (!err) {
+            net->w_fast_join = true;
+            goto connected;
+        }
+
+        syslog(LOG_WARN "Cached access point failed (err=%d), scanning", err);
     }
 
-    /* Connect to the network with a timeout of 10s. */
+    syslog("Scanning for Wi-Fi networks");
 
-    if (!net->w_found_networks) {
-        syslog("No network named %s found", net->w_ssid);
-        return ENOENT;
+    net->w_found_networks = 0;
+    if ((err = net->w_radio->scan(net, &best))) {
+        if (err == ENOENT)
+            syslog("No network named %s found", net->w_ssid);
+        else
+            syslog(LOG_ERR "Failed to scan (err=%d)", err);
+        return err;
     }
 
+    /* Connect to the strongest access point with a timeout of 10s. */
+
     syslog("Connecting to %s", net->w_ssid);
 
-    err = cyw43_arch_wifi_connect_timeout_ms(
-        net->w_ssid, MICRON_CONFIG_NET_PASSWD, CYW43_AUTH_WPA2_AES_PSK, 10000);
+    err = wifi_join(net, best.bssid, best.channel, WIFI_JOIN_TIMEOUT_MS);
     if (err) {
-        syslog(LOG_ERR "Wi-Fi connect timeout (err=%d)", err);
-        return 1;
+        syslog(LOG_ERR "Wi-Fi connect failed (err=%d)", err);
+        return err;
     }
 
+connected:
     net->w_connected = true;
+    net->iface = netif_default;
+    wifi_cache_update(net, &cache);
 
     return 0;
 }
 
+void wifi_dhcp_options(struct netif *__unused iface, u8 type,
+                       struct dhcp_msg *msg, u16 *len)
+{
+    /* Ask for the address we had last time. lwIP can't pick up an old lease
+       on its own, but most servers hand out the requested address if it's
+       still free, so the board keeps its IP across reboots. */
+
+    if (type != DHCP_DISCOVER || !wifi_dhcp_addr)
+        return;
+    if (*len + 6 >= DHCP_OPTIONS_LEN)
+        return;
+
+    msg->options[(*len)++] = DHCP_OPTION_REQUESTED_IP;
+    msg->options[(*len)++] = 4;
+    memcpy(&msg->options[*len], &wifi_dhcp_addr, 4);
+    *len += 4;
+}
+
 static void print_ifaces()
 {
     struct netif *iface;
@@ -111,25 +208,35 @@ static void print_ifaces()
 
 i32 wifi_init(struct net *net)
 {
+    absolute_time_t start;
+    u32 backoff;
+
     net->w_ssid = MICRON_CONFIG_NET_SSID;
+    start = get_absolute_time();
+    backoff = 1000;
 
     syslog("Trying to connect with '%s' '%s'", MICRON_CONFIG_NET_SSID,
            MICRON_CONFIG_NET_PASSWD);
 
     while (1) {
-        /* Try to connect to Wi-Fi. */
+        /* Try to connect to Wi-Fi, waiting a little longer each time. */
 
         if (wifi_connect(net)) {
-            syslog("Failed to connect to Wi-Fi, trying again in 5s...");
-            sleep_ms(5000);
+            syslog("Failed to connect to Wi-Fi, trying again in %ums...",
+                   backoff);
+            sleep_ms(backoff);
+            backoff = imin(backoff * 2, WIFI_RETRY_MAX_MS);
             continue;
         }
 
         break;
     }
 
+    net->w_ip_ms = absolute_time_diff_us(start, get_absolute_time()) / 1000;
+
     print_ifaces();
-    net->iface = netif_default;
+    syslog("Wi-Fi up in %ums (%s)", net->w_ip_ms,
+           net->w_fast_join ? "cached" : "scanned");
 
     return 0;
 }
@@ -1,14 +1,19 @@
 /* syslog.c - system logging
    Copyright (c) 2024 bellrise */
 
-#include <hardware/watchdog.h>
 #include <micron/micron.h>
 #include <micron/syslog.h>
+#include <pico.h>
 #include <pico/printf.h>
 #include <pico/time.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if PICO_ON_DEVICE
+# include <hardware/watchdog.h>
+#endif
+
 void syslog_impl(const char *file, const char *end, const char *fmt, ...)
 {
     va_list args;
@@ -50,8 +55,12 @@ void crash_impl(const char *file, int line, const char *fmt, ...)
     printf("\033[m\n\n");
     va_end(args);
 
-    /* Sleep 5s, and force reboot */
+    /* Sleep 5s, and force reboot. A host build has nothing to reboot. */
 
+#if PICO_ON_DEVICE
     sleep_ms(5000);
     watchdog_reboot(0, 0, 0);
+#else
+    abort();
+#endif
 }
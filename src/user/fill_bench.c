@@ -0,0 +1,74 @@
+/* fill_bench.c - page_fill benchmark
+   Copyright (c) 2025 bellrise */
+
+#include <micron/mem.h>
+#include <micron/micron.h>
+#include <micron/syslog.h>
+#include <pico/time.h>
+#include <string.h>
+
+/* Fills page runs of a few sizes with page_fill, which uses a DMA channel,
+   and with memset on the CPU, and reports the time each takes. Small runs
+   show what setting up the channel costs, bigger ones the throughput. The
+   async fill is timed until it returns, to show how much of the CPU is left
+   for other work while the channel runs. */
+
+#define BENCH_ROUNDS 64
+
+static const u32 bench_pages[] = {1, 4, 16, 64};
+
+static u32 bench_rate(uint64_t us, u32 pages)
+{
+    /* kB/s over all rounds. */
+
+    return (u32) ((uint64_t) pages * BENCH_ROUNDS * (PAGE_SIZE / 1024)
+                  * 1000000 / (us ? us : 1));
+}
+
+static void bench_run(u8 *run, u32 pages)
+{
+    uint64_t start;
+    uint64_t cpu;
+    uint64_t dma;
+    uint64_t issue;
+    i32 fill;
+
+    start = time_us_64();
+    for (u32 i = 0; i < BENCH_ROUNDS; i++)
+        memset(run, i, pages << PAGE_SIZE_BITS);
+    cpu = time_us_64() - start;
+
+    start = time_us_64();
+    for (u32 i = 0; i < BENCH_ROUNDS; i++)
+        page_fill(run, pages, i * 0x01010101);
+    dma = time_us_64() - start;
+
+    issue = 0;
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        start = time_us_64();
+        fill = page_fill_async(run, pages, i * 0x01010101);
+        issue += time_us_64() - start;
+        page_fill_wait(fill);
+    }
+
+    syslog("%3u pages: memset %6u kB/s, page_fill %6u kB/s, async start "
+           "%.2f us",
+           pages, bench_rate(cpu, pages), bench_rate(dma, pages),
+           (float) issue / BENCH_ROUNDS);
+}
+
+void user_main()
+{
+    u8 *run;
+
+    for (u32 i = 0; i < sizeof(bench_pages) / sizeof(*bench_pages); i++) {
+        run = page_alloc(bench_pages[i], 0);
+        if (!run) {
+            syslog(LOG_ERR "no run of %u pages", bench_pages[i]);
+            return;
+        }
+
+        bench_run(run, bench_pages[i]);
+        page_free(run);
+    }
+}
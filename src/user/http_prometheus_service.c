@@ -4,24 +4,31 @@
 #include <lwip/ip_addr.h>
 #include <micron/buildconfig.h>
 #include <micron/drv.h>
+#include <micron/mem.h>
 #include <micron/micron.h>
 #include <micron/net.h>
+#include <micron/netfilter.h>
 #include <micron/syslog.h>
 #include <pico/printf.h>
 #include <pico/time.h>
 #include <string.h>
 
+#define HTTP_MAXLINES 32
+#define HTTP_LINESIZE 256
+
 struct http_client
 {
-    u32 nlines;
-    u32 linesize;
-    u32 bufsize;
-    char **lines;
-    char *buf1;
-    char *http_header_buf;
+    struct mem_arena arena; /* per-request memory, reset after each client */
     struct drv *ds1820;
+    u32 zc_sent;            /* payloads passed to net_write_zc */
+    volatile u32 zc_done;   /* payloads acknowledged, counted on core 1 */
 };
 
+static void send_done(struct http_client *http)
+{
+    http->zc_done++;
+}
+
 static void split_http_line(char *line, char **method, char **path, char **ver)
 {
     char *p;
@@ -54,6 +61,7 @@ static void send_res(struct http_client *http, struct netsock *client,
                      const char *payload)
 {
     const char *http_fmt;
+    char *header;
 
     http_fmt = "HTTP/1.1 %s\r\n"
                "Server: micron-http\r\n"
@@ -61,10 +69,21 @@ static void send_res(struct http_client *http, struct netsock *client,
                "Content-Type: %s\r\n"
                "\r\n";
 
-    snprintf(http->http_header_buf, http->bufsize, http_fmt, statusname,
-             strlen(payload), content_type);
-    net_write(client, http->http_header_buf, strlen(http->http_header_buf));
-    net_write(client, payload, strlen(payload));
+    header = arena_printf(&http->arena, http_fmt, statusname, strlen(payload),
+                          content_type);
+    if (!header)
+        return;
+
+    /* The payload lives in the arena (or flash), so send it as-is. The arena
+       is only reset once all of the payloads are acknowledged. Corking makes
+       the header and the payload share segments. */
+
+    net_cork(client);
+    net_write(client, header, strlen(header));
+    if (!net_write_zc(client, payload, strlen(payload),
+                      (net_done_fn) send_done, http))
+        http->zc_sent++;
+    net_flush(client);
 }
 
 static void send_ok(struct http_client *http, struct netsock *client,
@@ -78,12 +97,11 @@ static void route_(struct http_client *http, struct netsock *client)
     const char *json_fmt;
     char *json_res;
 
-    json_res = http->buf1;
     json_fmt = "{\"firmware_version\": \"%s\"}";
+    json_res = arena_printf(&http->arena, json_fmt, MICRON_STRVER);
 
-    snprintf(json_res, http->bufsize, json_fmt, MICRON_STRVER);
-
-    send_ok(http, client, "application/json", json_res);
+    if (json_res)
+        send_ok(http, client, "application/json", json_res);
 }
 
 /* All info about the DS1820 interface is pulled from here:
@@ -142,19 +160,161 @@ static float ds1820_temperature(struct drv *ds1820)
     return (float) mem[0] / 2 * (mem[1] ? -1 : 1);
 }
 
+static char *net_metrics(struct http_client *http)
+{
+    struct net_sock_stats *ss;
+    struct net_stats stat;
+    const char *net_fmt;
+    const char *rule_fmt;
+    const char *sock_fmt;
+    const char *name;
+    usize size;
+    usize len;
+    char *rules;
+    char *socks;
+    u32 hits;
+
+    net_fmt = "# HELP netstat_rx_bytes Received bytes on netsockets\n"
+              "# TYPE netstat_rx_bytes counter\n"
+              "netstat_rx_bytes %u\n"
+              "# HELP netstat_tx_bytes Sent bytes on netsockets\n"
+              "# TYPE netstat_tx_bytes counter\n"
+              "netstat_tx_bytes %u\n"
+              "# HELP net_doorbell_avg_us Average time from a doorbell until its "
+              "work was handed to lwIP\n"
+              "# TYPE net_doorbell_avg_us gauge\n"
+              "net_doorbell_avg_us %u\n"
+              "# HELP net_doorbell_max_us Worst time from a doorbell until its "
+              "work was handed to lwIP\n"
+              "# TYPE net_doorbell_max_us gauge\n"
+              "net_doorbell_max_us %u\n"
+              "# HELP net_tx_segments TCP segments sent\n"
+              "# TYPE net_tx_segments counter\n"
+              "net_tx_segments %u\n"
+              "# HELP net_tx_responses Responses sent, for segments per "
+              "response\n"
+              "# TYPE net_tx_responses counter\n"
+              "net_tx_responses %u\n"
+              "# HELP net_accepts Connections accepted\n"
+              "# TYPE net_accepts counter\n"
+              "net_accepts %u\n"
+              "# HELP net_accept_drops Connections refused\n"
+              "# TYPE net_accept_drops counter\n"
+              "net_accept_drops %u\n"
+              "# HELP net_rx_drops Datagrams dropped\n"
+              "# TYPE net_rx_drops counter\n"
+              "net_rx_drops %u\n"
+              "# HELP net_icmp_packets ICMP packets handled\n"
+              "# TYPE net_icmp_packets counter\n"
+              "net_icmp_packets{kind=\"reply\"} %u\n"
+              "net_icmp_packets{kind=\"limited\"} %u\n"
+              "net_icmp_packets{kind=\"drop\"} %u\n"
+              "# HELP net_link_packets Packets on the link\n"
+              "# TYPE net_link_packets counter\n"
+              "net_link_packets{dir=\"tx\"} %u\n"
+              "net_link_packets{dir=\"rx\"} %u\n"
+              "net_link_packets{dir=\"drop\"} %u\n"
+              "net_link_packets{dir=\"err\"} %u\n"
+              "# HELP net_lwip_mem_bytes lwIP heap usage\n"
+              "# TYPE net_lwip_mem_bytes gauge\n"
+              "net_lwip_mem_bytes{kind=\"used\"} %u\n"
+              "net_lwip_mem_bytes{kind=\"max\"} %u\n"
+              "# HELP net_lwip_mem_errors Failed lwIP allocations\n"
+              "# TYPE net_lwip_mem_errors counter\n"
+              "net_lwip_mem_errors %u\n"
+              "# HELP net_link_up Whether the link is up\n"
+              "# TYPE net_link_up gauge\n"
+              "net_link_up %u\n"
+              "# HELP net_link_outages Times the link was lost\n"
+              "# TYPE net_link_outages counter\n"
+              "net_link_outages %u\n"
+              "# HELP net_link_outage_ms Time spent without a link\n"
+              "# TYPE net_link_outage_ms counter\n"
+              "net_link_outage_ms %u\n"
+              "# HELP net_link_outage_max_ms Longest time without a link\n"
+              "# TYPE net_link_outage_max_ms gauge\n"
+              "net_link_outage_max_ms %u\n"
+              "# HELP net_wifi_ip_ms Boot time from Wi-Fi start to an address\n"
+              "# TYPE net_wifi_ip_ms gauge\n"
+              "net_wifi_ip_ms{join=\"%s\"} %u\n"
+              "# HELP netsock_bytes Bytes on each open netsocket\n"
+              "# TYPE netsock_bytes counter\n"
+              "# HELP netsock_queued_bytes Bytes in the socket buffers\n"
+              "# TYPE netsock_queued_bytes gauge\n%s"
+              "# HELP netfilter_hits Packets matched by each NET_FILTER rule\n"
+              "# TYPE netfilter_hits counter\n%s";
+
+    sock_fmt = "netsock_bytes{id=\"%d\",dir=\"rx\"} %u\n"
+               "netsock_bytes{id=\"%d\",dir=\"tx\"} %u\n"
+               "netsock_queued_bytes{id=\"%d\",buf=\"read\"} %u\n"
+               "netsock_queued_bytes{id=\"%d\",buf=\"write\"} %u\n";
+
+    rule_fmt = "netfilter_hits{rule=\"%s\"} %u\n";
+
+    /* The stats block is shared with the network thread, reading it doesn't
+       wait for anything. */
+
+    net_stat(&stat);
+
+    /* Each list goes into a single allocation, big enough for every number
+       at its longest (10 digits), instead of copying what we have so far
+       for every line. */
+
+    size = stat.nsocks * (strlen(sock_fmt) + 8 * 10) + 1;
+    if ((socks = arena_alloc(&http->arena, size))) {
+        socks[0] = 0;
+        len = 0;
+
+        for (u32 i = 0; i < stat.nsocks; i++) {
+            ss = &stat.socks[i];
+            len += snprintf(socks + len, size - len, sock_fmt, ss->id,
+                            ss->rx_bytes, ss->id, ss->tx_bytes, ss->id,
+                            ss->rbuf_level, ss->id, ss->wbuf_level);
+        }
+    }
+
+    size = 1;
+    for (u32 i = 0; i < netfilter_nrules(); i++)
+        size += strlen(rule_fmt) + strlen(netfilter_rule(i, &hits)) + 10;
+
+    if ((rules = arena_alloc(&http->arena, size))) {
+        rules[0] = 0;
+        len = 0;
+
+        for (u32 i = 0; i < netfilter_nrules(); i++) {
+            name = netfilter_rule(i, &hits);
+            len += snprintf(rules + len, size - len, rule_fmt, name, hits);
+        }
+    }
+
+    return arena_printf(
+        &http->arena, net_fmt, stat.rx_bytes, stat.tx_bytes,
+        stat.doorbell_avg_us, stat.doorbell_max_us, stat.tx_segments,
+        stat.tx_responses, stat.accepts, stat.accept_drops, stat.rx_drops,
+        stat.icmp_replies, stat.icmp_limited, stat.icmp_drops,
+        stat.link_xmit, stat.link_recv, stat.link_drop, stat.link_err,
+        stat.lwip_mem_used, stat.lwip_mem_max, stat.lwip_mem_err,
+        stat.link_up, stat.link_outages, stat.link_outage_ms,
+        stat.link_outage_max_ms, stat.wifi_fast_join ? "cached" : "scan",
+        stat.wifi_ip_ms,
+        socks ? socks : "", rules ? rules : "");
+}
+
 static void route_metrics(struct http_client *http, struct netsock *client)
 {
     const char *reply_fmt;
+    const char *mem_fmt;
+    struct memstat stat;
     usize uptime_ms;
     float uptime;
     char *reply;
     char *temp_str;
     char *temp_reply;
+    char *mem_reply;
+    char *net_reply;
     float temp;
 
-    reply = http->buf1;
-    temp_reply = http->http_header_buf;
-    temp_reply[0] = 0;
+    temp_reply = "";
     uptime_ms = time_us_64() / 1000;
     uptime = (float) uptime_ms / 1000;
     temp = ds1820_temperature(http->ds1820);
@@ -162,23 +322,65 @@ static void route_metrics(struct http_client *http, struct netsock *client)
     reply_fmt = "# HELP uptime_total System uptime in unix format\n"
                 "# TYPE uptime_total counter\n"
                 "uptime_total %.2f\n"
-                "# HELP netstat_rx_bytes Received bytes on netsockets\n"
-                "# TYPE netstat_rx_bytes counter\n"
-                "netstat_rx_bytes %d\n"
-                "# HELP netstat_tx_bytes Sent bytes on netsockets\n"
-                "# TYPE netstat_tx_bytes counter\n"
-                "netstat_tx_bytes %d\n%s";
+                "# HELP http_arena_high_water_bytes Most memory used by a "
+                "request\n"
+                "# TYPE http_arena_high_water_bytes gauge\n"
+                "http_arena_high_water_bytes %zu\n%s%s%s";
+
+    mem_fmt = "# HELP mem_pages_used Allocated pages in the page heap\n"
+              "# TYPE mem_pages_used gauge\n"
+              "mem_pages_used %u\n"
+              "# HELP mem_pages_high_water Most pages allocated at once\n"
+              "# TYPE mem_pages_high_water gauge\n"
+              "mem_pages_high_water %u\n"
+              "# HELP mem_largest_free_run Biggest free run of pages\n"
+              "# TYPE mem_largest_free_run gauge\n"
+              "mem_largest_free_run %u\n"
+              "# HELP mem_fragmentation Free pages outside the largest run\n"
+              "# TYPE mem_fragmentation gauge\n"
+              "mem_fragmentation %.3f\n"
+              "# HELP mem_page_allocs Page allocations\n"
+              "# TYPE mem_page_allocs counter\n"
+              "mem_page_allocs %u\n"
+              "# HELP mem_page_frees Page frees\n"
+              "# TYPE mem_page_frees counter\n"
+              "mem_page_frees %u\n"
+              "# HELP mem_page_failures Failed page allocations\n"
+              "# TYPE mem_page_failures counter\n"
+              "mem_page_failures %u\n"
+              "# HELP mem_malloc_free_bytes Free bytes in the malloc heap\n"
+              "# TYPE mem_malloc_free_bytes gauge\n"
+              "mem_malloc_free_bytes %zu\n"
+              "# HELP mem_malloc_high_water_bytes Most bytes used by malloc\n"
+              "# TYPE mem_malloc_high_water_bytes gauge\n"
+              "mem_malloc_high_water_bytes %zu\n"
+              "# HELP stack_high_water_bytes Most stack used by a core\n"
+              "# TYPE stack_high_water_bytes gauge\n"
+              "stack_high_water_bytes{core=\"0\"} %zu\n"
+              "stack_high_water_bytes{core=\"1\"} %zu\n";
 
     temp_str = "# HELP sensor_temperature_0 Temperature on sensor 0\n"
                "# TYPE sensor_temperature_0 gauge\n"
                "sensor_temperature_0 %.2f\n";
 
-    if (temp != -1000)
-        snprintf(temp_reply, http->bufsize, temp_str, temp);
-    snprintf(reply, http->bufsize, reply_fmt, uptime, net_tx(), net_rx(),
-             temp_reply);
+    net_reply = net_metrics(http);
+    mem_stat(&stat);
+    mem_reply = arena_printf(
+        &http->arena, mem_fmt, stat.pages_used, stat.pages_high_water,
+        stat.largest_free_run, (float) stat.frag_permille / 1000, stat.allocs,
+        stat.frees, stat.failures, stat.malloc_free, stat.malloc_high_water,
+        stack_high_water(0), stack_high_water(1));
 
-    send_ok(http, client, "text/plain", reply);
+    if (temp != -1000)
+        temp_reply = arena_printf(&http->arena, temp_str, temp);
+    reply = arena_printf(&http->arena, reply_fmt, uptime,
+                         arena_high_water(&http->arena),
+                         net_reply ? net_reply : "",
+                         mem_reply ? mem_reply : "",
+                         temp_reply ? temp_reply : "");
+
+    if (reply)
+        send_ok(http, client, "text/plain", reply);
 }
 
 static void route_404(struct http_client *http, struct netsock *client)
@@ -206,40 +408,64 @@ static void accept_client(struct http_client *http, struct netsock *server)
     char *rq_method;
     char *rq_path;
     char *rq_ver;
+    char **lines;
+    iptr rpos;
+    iptr rlen;
     i32 nline;
     i32 wline;
+    u8 rbuf[64];
     u8 c;
 
     client = net_accept(server);
     nline = 0;
     wline = 0;
+    rpos = 0;
+    rlen = 0;
 
-    for (u32 i = 0; i < http->nlines; i++)
-        *http->lines[i] = 0;
+    /* Lines are allocated only when we get to them, and all of it goes away
+       with a single arena_reset once we're done with the client. */
+
+    lines = arena_alloc(&http->arena, HTTP_MAXLINES * sizeof(char *));
+    if (!lines || !(lines[0] = arena_alloc(&http->arena, HTTP_LINESIZE)))
+        goto end;
 
     while (1) {
-        net_read(client, &c, 1);
+        if (rpos == rlen) {
+            rpos = 0;
+            if ((rlen = net_read(client, rbuf, sizeof(rbuf))) <= 0)
+                goto end;
+        }
+
+        c = rbuf[rpos++];
 
         if (c == '\r')
             continue;
 
         /* Empty line, end of header. */
-        if (c == '\n' && !strlen(http->lines[nline]))
+        if (c == '\n' && !wline)
             break;
 
         if (c == '\n') {
-            http->lines[nline][wline] = 0;
-            nline++;
+            lines[nline][wline] = 0;
             wline = 0;
+
+            /* Anything past the last line is dropped. */
+            if (nline == HTTP_MAXLINES - 1)
+                continue;
+            if (!(lines[++nline] = arena_alloc(&http->arena, HTTP_LINESIZE)))
+                goto end;
             continue;
         }
 
-        http->lines[nline][wline++] = (char) c;
+        if (wline < HTTP_LINESIZE - 1)
+            lines[nline][wline++] = (char) c;
     }
 
+    lines[nline][wline] = 0;
+
     /* Stupid routing */
 
-    split_http_line(http->lines[0], &rq_method, &rq_path, &rq_ver);
+    split_http_line(lines[0], &rq_method, &rq_path, &rq_ver);
     printf("[\033[1mhttp\033[m] \033[32m%s\033[0m \033[35m%s\033[m "
            "\033[34m%s\033[0m\n",
            rq_method, rq_path, rq_ver);
@@ -265,6 +491,11 @@ end:
     /* Close the connection after replying. */
 
     net_close(client);
+
+    while (http->zc_done != http->zc_sent)
+        __wfe();
+
+    arena_reset(&http->arena);
 }
 
 static void http_service()
@@ -283,16 +514,9 @@ static void http_service()
         return;
     }
 
-    http_client.nlines = 32;
-    http_client.bufsize = 1024;
-    http_client.linesize = 256;
-
-    http_client.buf1 = malloc(http_client.bufsize);
-    http_client.http_header_buf = malloc(http_client.bufsize);
-    http_client.lines = malloc(http_client.nlines * sizeof(char *));
-
-    for (u32 i = 0; i < http_client.nlines; i++)
-        http_client.lines[i] = malloc(http_client.linesize);
+    arena_init(&http_client.arena, 2);
+    http_client.zc_sent = 0;
+    http_client.zc_done = 0;
 
     while (1)
         accept_client(&http_client, server);
@@ -0,0 +1,115 @@
+/* net_loopback.c - netsock benchmark over the host loopback
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/errno.h>
+#include <micron/net.h>
+#include <micron/syslog.h>
+#include <pico/time.h>
+#include <string.h>
+
+/* Runs on a host build, where net_init brings up the loopback backend. A
+   client and a server socket on the same stack talk through the whole
+   TCP/IP path, so this measures what net.c and api.c cost without a board
+   or an access point in the way. */
+
+#define LOOP_PORT  7
+#define LOOP_BYTES (8 * 1024 * 1024)
+#define LOOP_PINGS 10000
+
+static void loop_stream(struct netsock *tx, struct netsock *rx)
+{
+    u8 buf[MICRON_CONFIG_NET_RWBUF];
+    uint64_t start;
+    uint64_t us;
+    usize sent;
+    usize got;
+    iptr n;
+
+    /* Keep the write buffer full and the read buffer empty, from a single
+       thread. */
+
+    net_setflags(tx, NS_NONBLOCK);
+    net_setflags(rx, NS_NONBLOCK);
+    memset(buf, 0x5a, sizeof(buf));
+    sent = 0;
+    got = 0;
+
+    start = time_us_64();
+
+    while (got < LOOP_BYTES) {
+        if (sent < LOOP_BYTES) {
+            n = net_write(tx, buf, imin(sizeof(buf), LOOP_BYTES - sent));
+            if (n > 0)
+                sent += n;
+        }
+
+        n = net_read(rx, buf, sizeof(buf));
+        if (n > 0)
+            got += n;
+        else if (n != -EAGAIN)
+            break;
+    }
+
+    us = time_us_64() - start;
+
+    syslog("stream: %zu kB in %u ms, %u kB/s", got >> 10, (u32) (us / 1000),
+           (u32) ((uint64_t) got * 1000000 / 1024 / (us ? us : 1)));
+}
+
+static void loop_ping(struct netsock *tx, struct netsock *rx)
+{
+    uint64_t start;
+    uint64_t us;
+    u8 byte;
+
+    /* A single byte each way, waiting for the answer every time. */
+
+    net_setflags(tx, NS_NODELAY);
+    net_setflags(rx, NS_NODELAY);
+    byte = 0;
+
+    start = time_us_64();
+
+    for (u32 i = 0; i < LOOP_PINGS; i++) {
+        if (net_write(tx, &byte, 1) != 1 || net_read_full(rx, &byte, 1) != 1)
+            break;
+        if (net_write(rx, &byte, 1) != 1 || net_read_full(tx, &byte, 1) != 1)
+            break;
+    }
+
+    us = time_us_64() - start;
+
+    syslog("ping: %u round trips, %u us each", LOOP_PINGS,
+           (u32) (us / LOOP_PINGS));
+}
+
+void user_main()
+{
+    struct netsock *server;
+    struct netsock *client;
+    struct netsock *peer;
+
+    if (net_init()) {
+        syslog(LOG_ERR "net_init failed");
+        return;
+    }
+
+    server = net_socket();
+    client = net_socket();
+
+    if (net_bind(server, net_iface_ip(), LOOP_PORT)
+        || net_connect(client, net_iface_ip(), LOOP_PORT)) {
+        syslog(LOG_ERR "failed to set up the connection");
+        return;
+    }
+
+    peer = net_accept(server);
+
+    loop_stream(client, peer);
+    loop_ping(client, peer);
+
+    net_close(peer);
+    net_close(client);
+    net_close(server);
+}
@@ -39,8 +39,7 @@ void user_main()
 
     for (i32 j = 0; j < 50; j++) {
         color = color_convert(display, j % 2 == 0 ? 0xffffff : 0);
-        for (i32 i = 0; i < 320 * 240; i++)
-            pixels[i] = color;
+        page_fill(pixels, 150, color | (u32) color << 16);
 
         display->ioctl(display, WSPICO2SYNC);
     }
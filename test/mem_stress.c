@@ -0,0 +1,201 @@
+/* mem_stress.c - page heap & slab caches used from both cores at once
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/host.h>
+#include <micron/mem.h>
+#include <pico/time.h>
+#include <pico/util/queue.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Two threads stand in for the two cores, see host/sync.c. Each one keeps a
+   few page runs and slab objects filled with its own pattern, and checks the
+   pattern before freeing them. Every fourth run is handed to the other core
+   to free instead, so the magazines also see pages they didn't give out. If
+   the locking is broken, the cores end up with the same pages, and sooner or
+   later one of them finds the other one's pattern. */
+
+#define OPS     500000
+#define LIVE    8
+#define MAXRUN  3
+#define OBJSIZE 48
+
+struct chunk
+{
+    u32 *addr;
+    u32 words;
+    u32 pattern;
+};
+
+extern struct meminfo __micron_meminfo;
+
+static struct mem_cache *cache;
+static queue_t handoff[2];
+static volatile u32 errors;
+
+static u32 rand_next(u32 *rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return *rng;
+}
+
+static void chunk_fill(struct chunk *c, u32 pattern)
+{
+    c->pattern = pattern;
+    for (u32 i = 0; i < c->words; i++)
+        c->addr[i] = pattern + i;
+}
+
+static void chunk_check(struct chunk *c, const char *what)
+{
+    for (u32 i = 0; i < c->words; i++) {
+        if (c->addr[i] != c->pattern + i) {
+            printf("core %u: %s %p overwritten at word %u\n", get_core_num(),
+                   what, c->addr, i);
+            errors++;
+            return;
+        }
+    }
+}
+
+static void drain(u32 core)
+{
+    struct chunk c;
+
+    while (queue_try_remove(&handoff[core], &c)) {
+        chunk_check(&c, "handed off run");
+        page_free(c.addr);
+    }
+}
+
+static void *stress(void *arg)
+{
+    struct chunk runs[LIVE];
+    struct chunk objs[LIVE];
+    struct chunk *c;
+    u32 pages;
+    u32 core;
+    u32 rng;
+
+    core = (uptr) arg;
+    host_set_core(core);
+    rng = 0x9e3779b9 * (core + 1);
+    memset(runs, 0, sizeof(runs));
+    memset(objs, 0, sizeof(objs));
+
+    for (u32 op = 0; op < OPS; op++) {
+        drain(core);
+
+        /* Every op either frees a live chunk, or allocates a new one. */
+
+        if (rand_next(&rng) % 2) {
+            c = &runs[rand_next(&rng) % LIVE];
+            if (c->addr) {
+                chunk_check(c, "run");
+                if (op % 4 || !queue_try_add(&handoff[!core], c))
+                    page_free(c->addr);
+                c->addr = NULL;
+                continue;
+            }
+
+            pages = 1 + rand_next(&rng) % MAXRUN;
+            if (!(c->addr = page_alloc(pages, 0)))
+                continue;
+            c->words = pages * PAGE_SIZE / 4;
+            chunk_fill(c, (core << 31) | op << 8);
+        } else {
+            c = &objs[rand_next(&rng) % LIVE];
+            if (c->addr) {
+                chunk_check(c, "object");
+                mem_cache_free(cache, c->addr);
+                c->addr = NULL;
+                continue;
+            }
+
+            if (!(c->addr = mem_cache_alloc(cache)))
+                continue;
+            c->words = OBJSIZE / 4;
+            chunk_fill(c, (core << 31) | op << 8);
+        }
+    }
+
+    for (u32 i = 0; i < LIVE; i++) {
+        if (runs[i].addr)
+            page_free(runs[i].addr);
+        if (objs[i].addr)
+            mem_cache_free(cache, objs[i].addr);
+    }
+
+    return NULL;
+}
+
+int main()
+{
+    struct memstat before;
+    struct memstat after;
+    uint64_t start;
+    uint64_t us;
+    pthread_t other;
+    u32 allocs;
+    u32 used;
+
+    _mem_init();
+    printf("%u pages\n", __micron_meminfo.n_pages);
+
+    cache = mem_cache_create("stress", OBJSIZE, 8);
+    queue_init(&handoff[0], sizeof(struct chunk), LIVE);
+    queue_init(&handoff[1], sizeof(struct chunk), LIVE);
+    mem_stat(&before);
+
+    start = time_us_64();
+    pthread_create(&other, NULL, stress, (void *) 1);
+    stress((void *) 0);
+    pthread_join(other, NULL);
+    us = time_us_64() - start;
+
+    drain(0);
+    drain(1);
+    mem_stat(&after);
+
+    /* The cache keeps an empty slab around, which is the only thing that
+       may still be allocated. With MICRON_CONFIG_MEM_MALLOC, libc keeps a
+       few allocations for the thread as well. */
+
+    allocs = after.allocs - before.allocs;
+#if !MICRON_CONFIG_MEM_MALLOC
+    if (allocs - cache->n_slabs != after.frees - before.frees) {
+        printf("%u page allocs but %u frees\n", allocs,
+               after.frees - before.frees);
+        errors++;
+    }
+#endif
+
+    /* A lost update to the pagemap or the core shows up as a mismatch
+       between the two. */
+
+    used = 0;
+    for (u32 i = 0; i < __micron_meminfo.n_pages; i++)
+        used += (__micron_meminfo.pagemap[i] & PF_ALLOC) != 0;
+
+    if (used != after.pages_used) {
+        printf("%u pages marked in the pagemap, %u used\n", used,
+               after.pages_used);
+        errors++;
+    }
+
+    if (cache->n_active) {
+        printf("%u slab objects still active\n", cache->n_active);
+        errors++;
+    }
+
+    printf("%u ops on 2 cores in %u ms, %.2f Mops/s, %u page allocs, %u "
+           "failed\n",
+           2 * OPS, (u32) (us / 1000), 2.0 * OPS / (us ? us : 1), allocs,
+           after.failures - before.failures);
+
+    return errors != 0;
+}
@@ -0,0 +1,113 @@
+/* net_chksum.c - incremental echo reply checksum
+   Copyright (c) 2025 bellrise */
+
+#include <lwip/inet_chksum.h>
+#include <lwip/prot/icmp.h>
+#include <micron/buildconfig.h>
+#include <micron/net.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Echo replies are built in the request, with the checksum updated for the
+   changed type & code instead of summed again. Do the same to random echo
+   requests, and compare the result with lwIP summing the whole reply. The
+   edge cases are payloads which are all zeros or all ones, and odd lengths,
+   where the last byte is summed on its own. Data which sums to 0xffff
+   verifies with both 0 and 0xffff, lwIP picks 0 and we pick 0xffff, which
+   is the only one that works for a reply of all zeros. */
+
+#define ROUNDS  100000
+#define MAXSIZE 1480
+
+static u8 packet[MAXSIZE];
+static u32 rng = 0x2545f491;
+
+static u32 rand_next()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static int check_reply(u16 len)
+{
+    struct icmp_echo_hdr *icmp;
+    u16 adjusted;
+    u16 expect;
+    u16 old;
+
+    icmp = (struct icmp_echo_hdr *) packet;
+    icmp->type = ICMP_ECHO;
+    icmp->chksum = 0;
+    icmp->chksum = inet_chksum(packet, len);
+
+    /* Same as icmp_recv. */
+
+    old = *(u16 *) icmp;
+    icmp->type = ICMP_ER;
+    icmp->code = 0;
+    adjusted = net_chksum_adjust(icmp->chksum, old, *(u16 *) icmp);
+
+    icmp->chksum = 0;
+    expect = inet_chksum(packet, len);
+
+    if (adjusted != expect && !(adjusted == 0xffff && !expect)) {
+        printf("%u bytes, code %u: got %04x, expected %04x\n", len,
+               (u8) (old >> 8), adjusted, expect);
+        return 1;
+    }
+
+    /* What the other side checks: the reply sums to zero. */
+
+    icmp->chksum = adjusted;
+    if (inet_chksum(packet, len)) {
+        printf("%u bytes: reply doesn't verify\n", len);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int check_fill(u8 byte)
+{
+    for (u16 len = sizeof(struct icmp_echo_hdr); len <= 64; len++) {
+        memset(packet, byte, sizeof(packet));
+        if (check_reply(len))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int check_random()
+{
+    u16 len;
+
+    for (u32 i = 0; i < ROUNDS; i++) {
+        len = sizeof(struct icmp_echo_hdr)
+            + rand_next() % (MAXSIZE - sizeof(struct icmp_echo_hdr) + 1);
+
+        for (u16 j = 0; j < len; j++)
+            packet[j] = rand_next();
+
+        /* Most requests have code 0, but anything has to work. */
+
+        if (rand_next() % 2)
+            packet[1] = 0;
+
+        if (check_reply(len))
+            return 1;
+    }
+
+    return 0;
+}
+
+int main()
+{
+    if (check_fill(0x00) || check_fill(0xff) || check_random())
+        return 1;
+
+    printf("%u echo replies match a full checksum\n", ROUNDS);
+    return 0;
+}
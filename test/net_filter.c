@@ -0,0 +1,275 @@
+/* net_filter.c - NET_FILTER rule table
+   Copyright (c) 2025 bellrise */
+
+#include <lwip/def.h>
+#include <lwip/init.h>
+#include <lwip/pbuf.h>
+#include <lwip/prot/icmp.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/tcp.h>
+#include <lwip/prot/udp.h>
+#include <micron/buildconfig.h>
+#include <micron/netfilter.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Built with the rules from net_filter.config. Sends connection requests,
+   datagrams and pings from addresses around every rule edge through
+   netfilter_input, and checks each verdict and hit counter against a plain
+   reading of the rules: of those matching the address, protocol & port, the
+   longest prefix wins, and the first one written if there are several. The
+   rules are read back from their names, so the test doesn't depend on the
+   table mkgenconfig made from them. */
+
+#define RANDOM_ADDRS 20000
+
+struct ref_rule
+{
+    bool allow;
+    u32 lo;
+    u32 hi;
+    u32 bits;
+    u8 proto;
+    u16 port_lo;
+    u16 port_hi;
+};
+
+static struct ref_rule rules[MICRON_NETFILTER_NRULES];
+static u32 n_rules;
+static u32 hits[MICRON_NETFILTER_NRULES + 1];
+static u32 rng = 0x2545f491;
+
+static const u8 protos[] = {IP_PROTO_ICMP, IP_PROTO_TCP, IP_PROTO_UDP};
+
+static u32 rand_next()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static int parse_rule(const char *name, struct ref_rule *rule)
+{
+    char verdict[8];
+    char addr[32];
+    char proto[8];
+    char ports[16];
+    u32 a, b, c, d;
+    u32 lo, hi;
+    int words;
+
+    words = sscanf(name, "%7s %31s %7s %15s", verdict, addr, proto, ports);
+    if (words < 2)
+        return 1;
+
+    rule->allow = !strcmp(verdict, "allow");
+    rule->bits = 32;
+
+    if (!strcmp(addr, "*") || !strcmp(addr, "any")) {
+        a = b = c = d = 0;
+        rule->bits = 0;
+    } else if (sscanf(addr, "%u.%u.%u.%u/%u", &a, &b, &c, &d, &rule->bits)
+               < 4) {
+        return 1;
+    }
+
+    rule->lo = (a << 24) | (b << 16) | (c << 8) | d;
+    rule->hi = rule->lo | (rule->bits ? (1ull << (32 - rule->bits)) - 1
+                                      : 0xffffffff);
+
+    rule->proto = 0;
+    if (words > 2) {
+        if (!strcmp(proto, "icmp"))
+            rule->proto = IP_PROTO_ICMP;
+        else if (!strcmp(proto, "tcp"))
+            rule->proto = IP_PROTO_TCP;
+        else if (!strcmp(proto, "udp"))
+            rule->proto = IP_PROTO_UDP;
+        else
+            return 1;
+    }
+
+    rule->port_lo = 0;
+    rule->port_hi = 0xffff;
+    if (words > 3) {
+        if (sscanf(ports, "%u-%u", &lo, &hi) == 1)
+            hi = lo;
+        rule->port_lo = lo;
+        rule->port_hi = hi;
+    }
+
+    return 0;
+}
+
+static u32 ref_check(u32 addr, u8 proto, u16 port)
+{
+    struct ref_rule *rule;
+    u32 best;
+
+    /* Index of the deciding rule, n_rules if none. */
+
+    best = n_rules;
+    for (u32 i = 0; i < n_rules; i++) {
+        rule = &rules[i];
+        if (addr < rule->lo || addr > rule->hi)
+            continue;
+        if (rule->proto && rule->proto != proto)
+            continue;
+        if (port < rule->port_lo || port > rule->port_hi)
+            continue;
+        if (best == n_rules || rule->bits > rules[best].bits)
+            best = i;
+    }
+
+    return best;
+}
+
+static int send_packet(u32 addr, u8 proto, u16 port)
+{
+    struct icmp_echo_hdr *icmp;
+    struct pbuf *packet;
+    struct tcp_hdr *tcp;
+    struct udp_hdr *udp;
+    struct ip_hdr *ip;
+    u8 *payload;
+
+    /* The filter only looks at the IP header and the start of the next one,
+       nothing else has to be valid. */
+
+    packet = pbuf_alloc(PBUF_RAW, IP_HLEN + TCP_HLEN, PBUF_RAM);
+    if (!packet) {
+        printf("out of pbufs\n");
+        exit(1);
+    }
+
+    payload = packet->payload;
+    memset(payload, 0, packet->len);
+
+    ip = (struct ip_hdr *) payload;
+    IPH_VHL_SET(ip, 4, IP_HLEN / 4);
+    IPH_PROTO_SET(ip, proto);
+    ip->src.addr = lwip_htonl(addr);
+
+    switch (proto) {
+    case IP_PROTO_ICMP:
+        icmp = (struct icmp_echo_hdr *) (payload + IP_HLEN);
+        ICMPH_TYPE_SET(icmp, ICMP_ECHO);
+        break;
+    case IP_PROTO_TCP:
+        tcp = (struct tcp_hdr *) (payload + IP_HLEN);
+        TCPH_FLAGS_SET(tcp, TCP_SYN);
+        tcp->dest = lwip_htons(port);
+        break;
+    case IP_PROTO_UDP:
+        udp = (struct udp_hdr *) (payload + IP_HLEN);
+        udp->dest = lwip_htons(port);
+        break;
+    }
+
+    /* A dropped packet is freed by the filter. */
+
+    if (netfilter_input(packet, NULL))
+        return 1;
+
+    pbuf_free(packet);
+    return 0;
+}
+
+static int check(u32 addr, u8 proto, u16 port)
+{
+    const char *name;
+    bool dropped;
+    u32 expect;
+    u32 now;
+
+    expect = ref_check(addr, proto, port);
+    dropped = send_packet(addr, proto, port);
+
+    if (dropped != (expect == n_rules || !rules[expect].allow)) {
+        printf("%08x proto %u port %u: %s, expected rule %u\n", addr, proto,
+               port, dropped ? "dropped" : "allowed", expect);
+        return 1;
+    }
+
+    /* Exactly the deciding rule has to count the packet. */
+
+    for (u32 i = 0; i <= n_rules; i++) {
+        name = netfilter_rule(i, &now);
+        if (now != hits[i] + (i == expect)) {
+            printf("%08x proto %u port %u: hit '%s', expected rule %u\n",
+                   addr, proto, port, name, expect);
+            return 1;
+        }
+        hits[i] = now;
+    }
+
+    return 0;
+}
+
+static int check_addr(u32 addr)
+{
+    static const u16 ports[] = {0, 1, 22, 53, 79, 80, 85, 90, 91, 443, 65535};
+
+    for (u32 i = 0; i < sizeof(protos); i++) {
+        for (u32 j = 0; j < sizeof(ports) / sizeof(*ports); j++) {
+            if (check(addr, protos[i], ports[j]))
+                return 1;
+            if (protos[i] == IP_PROTO_ICMP)
+                break;
+        }
+    }
+
+    return 0;
+}
+
+int main()
+{
+    u32 edges[4];
+    u32 n;
+
+    lwip_init();
+
+    n_rules = netfilter_nrules() - 1;
+    if (n_rules != MICRON_NETFILTER_NRULES) {
+        printf("%u rules, expected %u\n", n_rules, MICRON_NETFILTER_NRULES);
+        return 1;
+    }
+
+    for (u32 i = 0; i < n_rules; i++) {
+        if (parse_rule(netfilter_rule(i, &n), &rules[i])) {
+            printf("can't read rule '%s'\n", netfilter_rule(i, &n));
+            return 1;
+        }
+    }
+
+    /* Both ends of every rule, and the addresses just outside of them. */
+
+    for (u32 i = 0; i < n_rules; i++) {
+        edges[0] = rules[i].lo - 1;
+        edges[1] = rules[i].lo;
+        edges[2] = rules[i].hi;
+        edges[3] = rules[i].hi + 1;
+
+        for (u32 j = 0; j < 4; j++) {
+            if (check_addr(edges[j]))
+                return 1;
+        }
+    }
+
+    for (u32 i = 0; i < RANDOM_ADDRS; i++) {
+        if (check(rand_next(), protos[rand_next() % 3], rand_next()))
+            return 1;
+    }
+
+    /* Other protocols aren't filtered at all. */
+
+    if (send_packet(0x0b000000, IP_PROTO_IGMP, 0)) {
+        printf("IGMP was filtered\n");
+        return 1;
+    }
+
+    printf("%u rules agree with the table\n", n_rules);
+    return 0;
+}
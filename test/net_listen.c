@@ -0,0 +1,146 @@
+/* net_listen.c - closing a listener with clients in its backlog
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/errno.h>
+#include <micron/mem.h>
+#include <micron/net.h>
+#include <pico/time.h>
+#include <stdio.h>
+
+/* Connects a few clients to a listener over the loopback backend, and closes
+   the listener before any of them is accepted. The network thread has to
+   close the backlog along with it, and carry on: the clients see the
+   connection end, and a new listener still gets its clients. Each client
+   takes two sockets, one per side, and the listener one more. */
+
+#define PORT    80
+#define CLIENTS                                                                \
+    imin(MICRON_CONFIG_NET_BACKLOG, (MICRON_CONFIG_NET_MAXSOCK - 1) / 2)
+#define WAIT_MS 2000
+
+static struct netsock *clients[MICRON_CONFIG_NET_BACKLOG];
+
+static bool wait_accepts(u32 n)
+{
+    absolute_time_t deadline;
+    struct net_stats stats;
+
+    deadline = make_timeout_time_ms(WAIT_MS);
+
+    do {
+        net_stat(&stats);
+        if (stats.accepts >= n)
+            return true;
+        sleep_ms(1);
+    } while (!time_reached(deadline));
+
+    printf("%u of %u clients queued\n", stats.accepts, n);
+    return false;
+}
+
+static bool wait_closed(struct netsock *sock)
+{
+    absolute_time_t deadline;
+    u8 byte;
+
+    deadline = make_timeout_time_ms(WAIT_MS);
+
+    do {
+        if (net_read(sock, &byte, 1) != -EAGAIN)
+            return true;
+        sleep_ms(1);
+    } while (!time_reached(deadline));
+
+    return false;
+}
+
+static bool wait_byte(u8 expect)
+{
+    absolute_time_t deadline;
+    u8 byte;
+
+    /* We don't know which client the listener accepted first. */
+
+    deadline = make_timeout_time_ms(WAIT_MS);
+
+    do {
+        for (i32 i = 0; i < CLIENTS; i++) {
+            if (net_read(clients[i], &byte, 1) == 1)
+                return byte == expect;
+        }
+        sleep_ms(1);
+    } while (!time_reached(deadline));
+
+    return false;
+}
+
+static int connect_all(struct netsock *server, u16 port, u32 accepts)
+{
+    if (net_bind(server, net_iface_ip(), port)) {
+        printf("bind failed\n");
+        return 1;
+    }
+
+    for (i32 i = 0; i < CLIENTS; i++) {
+        if (!(clients[i] = net_socket())) {
+            printf("no socket for client %d\n", i);
+            return 1;
+        }
+
+        net_setflags(clients[i], NS_NONBLOCK);
+        if (net_connect(clients[i], net_iface_ip(), port)) {
+            printf("client %d failed to connect\n", i);
+            return 1;
+        }
+    }
+
+    return !wait_accepts(accepts + CLIENTS);
+}
+
+int main()
+{
+    struct netsock *server;
+    struct netsock *peer;
+    u8 byte;
+
+    _mem_init();
+
+    if (net_init()) {
+        printf("net_init failed\n");
+        return 1;
+    }
+
+    server = net_socket();
+    if (connect_all(server, PORT, 0))
+        return 1;
+
+    net_close(server);
+
+    for (i32 i = 0; i < CLIENTS; i++) {
+        if (!wait_closed(clients[i])) {
+            printf("client %d still open after its listener\n", i);
+            return 1;
+        }
+        net_close(clients[i]);
+    }
+
+    /* The network thread is still alive if a new listener gets its clients,
+       and they can talk. The old port is still taken by the closed
+       connections. */
+
+    server = net_socket();
+    if (connect_all(server, PORT + 1, CLIENTS))
+        return 1;
+
+    peer = net_accept(server);
+    byte = 0x5a;
+
+    if (net_write(peer, &byte, 1) != 1 || !wait_byte(byte)) {
+        printf("no data after reopening the listener\n");
+        return 1;
+    }
+
+    printf("%d clients closed with their listener\n", CLIENTS);
+    return 0;
+}
@@ -0,0 +1,190 @@
+/* net_udp.c - datagram framing over the loopback backend
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/errno.h>
+#include <micron/mem.h>
+#include <micron/net.h>
+#include <pico/time.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Datagrams share the byte rings with their descriptors, so each one has to
+   come out exactly as it went in: a short read drops the rest of that
+   datagram and nothing else, a full write buffer takes only whole
+   datagrams, and one which can never fit the write buffer is refused. */
+
+#define PORT    7
+#define WAIT_MS 2000
+#define MAXMSGS 64
+
+#define check(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);                  \
+            return 1;                                                          \
+        }                                                                      \
+    } while (0)
+
+static struct netsock *server;
+static struct netsock *client;
+static u8 sent_data[MICRON_CONFIG_NET_RWBUF];
+static u8 recv_data[MICRON_CONFIG_NET_RWBUF];
+
+static void fill(u8 *buf, usize len, u8 seed)
+{
+    for (usize i = 0; i < len; i++)
+        buf[i] = seed + i;
+}
+
+static iptr recv_wait(usize size, ip_addr_t *addr, u16 *port)
+{
+    absolute_time_t deadline;
+    iptr res;
+
+    deadline = make_timeout_time_ms(WAIT_MS);
+
+    do {
+        res = net_recvfrom(server, recv_data, size, addr, port);
+        if (res != -EAGAIN)
+            return res;
+        sleep_ms(1);
+    } while (!time_reached(deadline));
+
+    return -EAGAIN;
+}
+
+static bool drained(struct netsock *sock)
+{
+    absolute_time_t deadline;
+
+    deadline = make_timeout_time_ms(WAIT_MS);
+
+    while (!ring_is_empty(&sock->wbuf)) {
+        if (time_reached(deadline))
+            return false;
+        sleep_ms(1);
+    }
+
+    return true;
+}
+
+static int test_truncate()
+{
+    ip_addr_t addr;
+    usize len;
+    u16 port;
+
+    /* Read only the start of the first datagram, the second one has to come
+       out whole after it. */
+
+    len = MICRON_CONFIG_NET_RWBUF / 4;
+
+    fill(sent_data, len, 1);
+    check(!net_sendto(client, sent_data, len, net_iface_ip(), PORT));
+    fill(sent_data, len, 2);
+    check(!net_sendto(client, sent_data, len, net_iface_ip(), PORT));
+
+    memset(recv_data, 0, sizeof(recv_data));
+    check(recv_wait(10, &addr, &port) == (iptr) len);
+    fill(sent_data, len, 1);
+    check(!memcmp(recv_data, sent_data, 10));
+    check(recv_data[10] == 0);
+    check(addr.addr == net_iface_ip().addr && port);
+
+    check(recv_wait(sizeof(recv_data), NULL, NULL) == (iptr) len);
+    fill(sent_data, len, 2);
+    check(!memcmp(recv_data, sent_data, len));
+
+    return 0;
+}
+
+static int test_full()
+{
+    struct net_msg msgs[MAXMSGS];
+    iptr sent;
+    usize len;
+
+    /* net_sendmmsg only rings the doorbell once it's done, so unless the
+       network thread wakes up for a timer in between, the write buffer isn't
+       drained while it runs. A batch much bigger than the buffer then only
+       gets some of its datagrams in, and all of those have to arrive. */
+
+    len = MICRON_CONFIG_NET_RWBUF / 4;
+    fill(sent_data, len, 3);
+
+    for (u32 i = 0; i < MAXMSGS; i++) {
+        msgs[i].buf = sent_data;
+        msgs[i].len = len;
+        msgs[i].addr = net_iface_ip();
+        msgs[i].port = PORT;
+    }
+
+    check(drained(client));
+    sent = net_sendmmsg(client, msgs, MAXMSGS);
+    check(sent > 0 && sent < MAXMSGS);
+
+    for (iptr i = 0; i < sent; i++) {
+        memset(recv_data, 0, sizeof(recv_data));
+        check(recv_wait(sizeof(recv_data), NULL, NULL) == (iptr) len);
+        check(!memcmp(recv_data, sent_data, len));
+    }
+
+    printf("%d of %d datagrams fit the write buffer\n", (int) sent, MAXMSGS);
+    return 0;
+}
+
+static int test_oversize()
+{
+    usize max;
+
+    /* The biggest datagram which fits next to its descriptor is fine, one
+       byte more never can be. */
+
+    max = MICRON_CONFIG_NET_RWBUF - sizeof(struct net_dgram);
+    fill(sent_data, max, 4);
+
+    check(drained(client));
+    check(net_sendto(client, sent_data, max + 1, net_iface_ip(), PORT)
+          == -EINVAL);
+    check(!net_sendto(client, sent_data, max, net_iface_ip(), PORT));
+
+    check(recv_wait(sizeof(recv_data), NULL, NULL) == (iptr) max);
+    check(!memcmp(recv_data, sent_data, max));
+
+    return 0;
+}
+
+int main()
+{
+    _mem_init();
+
+    if (net_init()) {
+        printf("net_init failed\n");
+        return 1;
+    }
+
+    server = net_socket_udp();
+    client = net_socket_udp();
+    if (!server || !client) {
+        printf("no socket\n");
+        return 1;
+    }
+
+    net_setflags(server, NS_NONBLOCK);
+    net_setflags(client, NS_NONBLOCK);
+
+    if (net_bind(server, net_iface_ip(), PORT)) {
+        printf("bind failed\n");
+        return 1;
+    }
+
+    if (test_truncate() || test_full() || test_oversize())
+        return 1;
+
+    net_close(client);
+    net_close(server);
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,107 @@
+/* netctrl_bench.c - netctrl command round trip
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/mem.h>
+#include <micron/net.h>
+#include <pico/time.h>
+#include <stdio.h>
+
+/* Times how long a command takes from netctrl_submit on core 0 until core 1
+   marks it done, over the loopback backend. Connecting a UDP socket only
+   sets its default peer, so the command itself costs next to nothing and
+   can be repeated. First one command at a time, like the blocking calls do,
+   then a whole ring of them submitted at once and run in one batch. */
+
+#define ROUNDS 20000
+#define PORT   9
+
+static struct netctrl_req reqs[NET_CTRL_RING];
+
+static void req_connect(struct netctrl_req *req, struct netsock *sock)
+{
+    req->cmd = NC_CONNECT;
+    req->args[0] = (uptr) sock;
+    req->args[1] = net_iface_ip().addr;
+    req->args[2] = PORT;
+    req->cb = NULL;
+}
+
+static int bench_single(struct netsock *sock)
+{
+    uint64_t start;
+    uint64_t us;
+
+    start = time_us_64();
+
+    for (u32 i = 0; i < ROUNDS; i++) {
+        req_connect(&reqs[0], sock);
+        netctrl_submit(&reqs[0]);
+        if (netctrl_wait(&reqs[0])) {
+            printf("connect failed\n");
+            return 1;
+        }
+    }
+
+    us = time_us_64() - start;
+    printf("single: %u commands, %.2f us each\n", ROUNDS,
+           (double) us / ROUNDS);
+
+    return 0;
+}
+
+static int bench_batch(struct netsock *sock)
+{
+    uint64_t start;
+    uint64_t us;
+    u32 id;
+
+    start = time_us_64();
+
+    for (u32 i = 0; i < ROUNDS / NET_CTRL_RING; i++) {
+        for (u32 j = 0; j < NET_CTRL_RING; j++) {
+            req_connect(&reqs[j], sock);
+            id = netctrl_submit(&reqs[j]);
+        }
+
+        /* IDs are handed out in submit order. */
+
+        for (u32 j = 0; j < NET_CTRL_RING; j++) {
+            if (netctrl_wait(&reqs[j])
+                || reqs[j].id != id - NET_CTRL_RING + 1 + j) {
+                printf("request %u of a batch failed\n", j);
+                return 1;
+            }
+        }
+    }
+
+    us = time_us_64() - start;
+    printf("batch: %u commands in batches of %u, %.2f us each\n",
+           ROUNDS / NET_CTRL_RING * NET_CTRL_RING, NET_CTRL_RING,
+           (double) us / (ROUNDS / NET_CTRL_RING * NET_CTRL_RING));
+
+    return 0;
+}
+
+int main()
+{
+    struct netsock *sock;
+
+    _mem_init();
+
+    if (net_init()) {
+        printf("net_init failed\n");
+        return 1;
+    }
+
+    if (!(sock = net_socket_udp())) {
+        printf("no socket\n");
+        return 1;
+    }
+
+    if (bench_single(sock) || bench_batch(sock))
+        return 1;
+
+    net_close(sock);
+    return 0;
+}
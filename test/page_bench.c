@@ -0,0 +1,203 @@
+/* page_bench.c - page allocator core against the old first-fit scan
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/host.h>
+#include <micron/mem.h>
+#include <pico/time.h>
+#include <stdio.h>
+#include <string.h>
+
+/* page_alloc used to walk the pagemap, checking every offset with
+   is_empty_range until a run fit. The bitmap core has to pick the same runs
+   (it's still first-fit), only faster. The buddy core picks its own runs, so
+   with MICRON_CONFIG_MEM_BUDDY the runs are only checked for overlaps. */
+
+#define OPS    200000
+#define ROUNDS 10000
+#define MAXRUN 16
+
+extern struct meminfo __micron_meminfo;
+
+struct run
+{
+    u32 index;
+    u32 pages;
+};
+
+static u8 ref_map[HOST_RAM_SIZE / PAGE_SIZE];
+static struct run runs[HOST_RAM_SIZE / PAGE_SIZE];
+static u32 n_runs;
+static u32 rng = 0x2545f491;
+
+static u32 rand_next()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static bool is_empty_range(u32 offset, u32 size)
+{
+    for (u32 i = 0; i < size; i++) {
+        if (offset + i >= __micron_meminfo.n_pages)
+            return false;
+        if (ref_map[offset + i])
+            return false;
+    }
+
+    return true;
+}
+
+static i32 ref_alloc(u32 pages)
+{
+    for (u32 walker = 0; walker < __micron_meminfo.n_pages; walker++) {
+        if (is_empty_range(walker, pages))
+            return walker;
+    }
+
+    return -1;
+}
+
+static i32 core_alloc(u32 pages)
+{
+    u32 irq;
+    i32 index;
+
+    irq = _mem_lock();
+    index = _mem_core_alloc(pages, 0);
+    _mem_unlock(irq);
+
+    return index;
+}
+
+static void core_free(u32 index)
+{
+    u32 irq;
+
+    irq = _mem_lock();
+    _mem_core_free(index);
+    _mem_unlock(irq);
+}
+
+static void run_add(u32 index, u32 pages)
+{
+    memset(&ref_map[index], 1, pages);
+    runs[n_runs].index = index;
+    runs[n_runs++].pages = pages;
+}
+
+static void run_remove(u32 i)
+{
+    core_free(runs[i].index);
+    memset(&ref_map[runs[i].index], 0, runs[i].pages);
+    runs[i] = runs[--n_runs];
+}
+
+static int check_random()
+{
+    u32 pages;
+    i32 index;
+#if !MICRON_CONFIG_MEM_BUDDY
+    i32 expect;
+#endif
+
+    /* Random alloc & free, mostly small runs like the rest of micron. */
+
+    for (u32 op = 0; op < OPS; op++) {
+        if (n_runs && rand_next() % 2) {
+            run_remove(rand_next() % n_runs);
+            continue;
+        }
+
+        pages = 1 + rand_next() % (rand_next() % 8 ? 4 : MAXRUN);
+        index = core_alloc(pages);
+
+#if MICRON_CONFIG_MEM_BUDDY
+        if (index >= 0 && !is_empty_range(index, pages)) {
+            printf("op %u: run %d+%u overlaps\n", op, index, pages);
+            return 1;
+        }
+#else
+        if (index != (expect = ref_alloc(pages))) {
+            printf("op %u: %u pages at %d, first-fit says %d\n", op, pages,
+                   index, expect);
+            return 1;
+        }
+#endif
+
+        if (index >= 0)
+            run_add(index, pages);
+    }
+
+    while (n_runs)
+        run_remove(0);
+
+    printf("random: %u ops ok\n", OPS);
+    return 0;
+}
+
+static int bench_fragmented()
+{
+    uint64_t start;
+    uint64_t core_us;
+    uint64_t ref_us;
+    u32 big;
+    i32 index;
+
+    /* Fill the first 2/3 of the heap with single pages and free every other
+       one, then ask for a run which only fits in the last third. This is the
+       worst case for the old scan, which tries every hole on the way. */
+
+    for (u32 i = 0; i < __micron_meminfo.n_pages * 2 / 3; i++)
+        run_add(core_alloc(1), 1);
+    for (i32 i = n_runs - 1; i >= 0; i -= 2)
+        run_remove(i);
+
+    big = __micron_meminfo.n_pages / 4;
+
+    start = time_us_64();
+    for (u32 i = 0; i < ROUNDS; i++) {
+        if ((index = core_alloc(big)) < 0) {
+            printf("no room for %u pages\n", big);
+            return 1;
+        }
+        core_free(index);
+    }
+    core_us = time_us_64() - start;
+
+    start = time_us_64();
+    for (u32 i = 0; i < ROUNDS; i++) {
+        if (ref_alloc(big) < 0)
+            return 1;
+    }
+    ref_us = time_us_64() - start;
+
+    printf("fragmented: %u pages of %u, %.3f us per alloc, first-fit "
+           "%.3f us\n",
+           big, __micron_meminfo.n_pages, (double) core_us / ROUNDS,
+           (double) ref_us / ROUNDS);
+
+    while (n_runs)
+        run_remove(0);
+
+    return 0;
+}
+
+int main()
+{
+    _mem_init();
+    printf("%u pages\n", __micron_meminfo.n_pages);
+
+    /* Whatever was taken so far stays taken, including the stdout buffer
+       with MICRON_CONFIG_MEM_MALLOC. */
+
+    for (u32 i = 0; i < __micron_meminfo.n_pages; i++)
+        ref_map[i] = __micron_meminfo.pagemap[i] != 0;
+
+    if (check_random() || bench_fragmented())
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/* ring_bench.c - netsock ring buffers against the old byte queues
+   Copyright (c) 2025 bellrise */
+
+#include <micron/buildconfig.h>
+#include <micron/host.h>
+#include <micron/ring.h>
+#include <pico/time.h>
+#include <pico/util/queue.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+/* Moves BYTES bytes from core 1 to core 0 through a buffer of the netsock
+   size, first a byte at a time through a queue_t like net_read & net_write
+   used to, then in bulk through a ring. The consumer checks that every byte
+   arrives, in order. */
+
+#define BYTES (16 * 1024 * 1024)
+#define CHUNK 64
+
+static queue_t queue;
+static struct ring ring;
+static u8 ring_data[MICRON_CONFIG_NET_RWBUF];
+
+static void *queue_producer(void *arg)
+{
+    u8 byte;
+
+    (void) arg;
+    host_set_core(1);
+
+    for (u32 i = 0; i < BYTES; i++) {
+        byte = i % CHUNK;
+        queue_add_blocking(&queue, &byte);
+    }
+
+    return NULL;
+}
+
+static void *ring_producer(void *arg)
+{
+    u8 buf[CHUNK];
+    u32 sent;
+    u32 n;
+
+    (void) arg;
+    host_set_core(1);
+
+    for (u32 i = 0; i < CHUNK; i++)
+        buf[i] = i;
+
+    /* Every chunk carries the same bytes. */
+
+    for (sent = 0; sent < BYTES; sent += CHUNK) {
+        n = ring_write(&ring, buf, CHUNK);
+        while (n < CHUNK) {
+            sched_yield();
+            n += ring_write(&ring, buf + n, CHUNK - n);
+        }
+    }
+
+    return NULL;
+}
+
+static int queue_consume()
+{
+    u8 byte;
+
+    for (u32 i = 0; i < BYTES; i++) {
+        queue_remove_blocking(&queue, &byte);
+        if (byte != i % CHUNK) {
+            printf("queue: byte %u is %u\n", i, byte);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int ring_consume_all()
+{
+    u8 buf[MICRON_CONFIG_NET_RWBUF];
+    u32 got;
+    u32 n;
+
+    got = 0;
+
+    while (got < BYTES) {
+        if (!(n = ring_read(&ring, buf, sizeof(buf)))) {
+            sched_yield();
+            continue;
+        }
+
+        for (u32 i = 0; i < n; i++) {
+            if (buf[i] != (got + i) % CHUNK) {
+                printf("ring: byte %u is %u\n", got + i, buf[i]);
+                return 1;
+            }
+        }
+
+        got += n;
+    }
+
+    return 0;
+}
+
+static int bench(const char *name, void *(*producer)(void *),
+                 int (*consumer)(), u32 *kbps)
+{
+    uint64_t start;
+    uint64_t us;
+    pthread_t other;
+    int err;
+
+    start = time_us_64();
+    pthread_create(&other, NULL, producer, NULL);
+
+    /* On a mismatch, the producer is left stuck on a full buffer. */
+
+    if ((err = consumer()))
+        return err;
+    pthread_join(other, NULL);
+    us = time_us_64() - start;
+
+    *kbps = (uint64_t) BYTES * 1000000 / 1024 / (us ? us : 1);
+    printf("%s: %u MB in %u ms, %u kB/s\n", name, BYTES >> 20,
+           (u32) (us / 1000), *kbps);
+
+    return 0;
+}
+
+int main()
+{
+    u32 queue_kbps;
+    u32 ring_kbps;
+
+    queue_init(&queue, 1, MICRON_CONFIG_NET_RWBUF);
+    ring_init(&ring, ring_data, MICRON_CONFIG_NET_RWBUF, 1);
+
+    if (bench("queue", queue_producer, queue_consume, &queue_kbps)
+        || bench("ring", ring_producer, ring_consume_all, &ring_kbps))
+        return 1;
+
+    printf("ring is %.1fx the queue\n",
+           (double) ring_kbps / (queue_kbps ? queue_kbps : 1));
+
+    return 0;
+}
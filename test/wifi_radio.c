@@ -0,0 +1,249 @@
+/* wifi_radio.c - wifi_connect driven by a mock radio
+   Copyright (c) 2025 bellrise */
+
+#include <lwip/prot/dhcp.h>
+#include <micron/buildconfig.h>
+#include <micron/errno.h>
+#include <micron/mem.h>
+#include <micron/wifi.h>
+#include <stdio.h>
+#include <string.h>
+
+/* The mock radio has a single access point, which can move to another
+   channel or go away, and a flash sector holding the cache. Joining the
+   access point works only with its current BSSID & channel, any other join
+   fails at once like a radio which found nothing there. Each case boots with
+   whatever the previous one left in flash. */
+
+#define check(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);                  \
+            return 1;                                                          \
+        }                                                                      \
+    } while (0)
+
+struct mock
+{
+    bool ap_present;
+    u8 ap_bssid[6];
+    u16 ap_channel;
+    bool joined;
+    struct wifi_cache flash;
+    bool flash_written;
+    u32 scans;
+    u32 joins;
+    u32 saves;
+};
+
+static struct mock mock;
+static struct net net;
+
+static i32 mock_scan(struct net *net, struct wifi_scan *best)
+{
+    mock.scans++;
+    if (!mock.ap_present)
+        return ENOENT;
+
+    memcpy(best->bssid, mock.ap_bssid, sizeof(best->bssid));
+    best->channel = mock.ap_channel;
+    best->rssi = -50;
+    net->w_found_networks = 1;
+
+    return 0;
+}
+
+static i32 mock_join(struct net *__unused net, const u8 *bssid, u16 channel)
+{
+    mock.joins++;
+    mock.joined = mock.ap_present && bssid
+               && !memcmp(bssid, mock.ap_bssid, sizeof(mock.ap_bssid))
+               && channel == mock.ap_channel;
+    return 0;
+}
+
+static i32 mock_status(struct net *__unused net)
+{
+    return mock.joined ? WIFI_UP : -ENOENT;
+}
+
+static void mock_leave(struct net *__unused net)
+{
+    mock.joined = false;
+}
+
+static void mock_wait(struct net *__unused net, absolute_time_t __unused until)
+{
+}
+
+static i32 mock_load(struct wifi_cache *cache)
+{
+    /* An erased sector reads as all ones. */
+
+    if (!mock.flash_written)
+        memset(cache, 0xff, sizeof(*cache));
+    else
+        memcpy(cache, &mock.flash, sizeof(*cache));
+
+    return 0;
+}
+
+static void mock_save(const struct wifi_cache *cache)
+{
+    mock.saves++;
+    mock.flash_written = true;
+    memcpy(&mock.flash, cache, sizeof(*cache));
+}
+
+static const struct wifi_radio mock_radio = {
+    .scan = mock_scan,
+    .join = mock_join,
+    .status = mock_status,
+    .leave = mock_leave,
+    .wait = mock_wait,
+    .load = mock_load,
+    .save = mock_save,
+};
+
+static i32 boot(const char *ssid)
+{
+    memset(&net, 0, sizeof(net));
+    net.w_radio = &mock_radio;
+    net.w_ssid = ssid;
+    mock.scans = 0;
+    mock.joins = 0;
+    mock.saves = 0;
+    mock.joined = false;
+
+    return wifi_connect(&net);
+}
+
+static int test_cold()
+{
+    /* Nothing in flash yet, so scan first. */
+
+    check(!boot("home"));
+    check(mock.scans == 1 && mock.joins == 1);
+    check(!net.w_fast_join && net.w_channel == 6);
+    check(mock.saves == MICRON_CONFIG_NET_WIFI_CACHE);
+
+    return 0;
+}
+
+#if MICRON_CONFIG_NET_WIFI_CACHE
+
+static int test_cached()
+{
+    /* Same access point, join it directly. The cache hasn't changed, so
+       there is nothing to write. */
+
+    check(!boot("home"));
+    check(mock.scans == 0 && mock.joins == 1);
+    check(net.w_fast_join);
+    check(mock.saves == 0);
+
+    return 0;
+}
+
+static int test_moved()
+{
+    /* The access point moved to another channel, so the cached join fails,
+       and the new channel has to be written back. */
+
+    mock.ap_channel = 11;
+
+    check(!boot("home"));
+    check(mock.scans == 1 && mock.joins == 2);
+    check(!net.w_fast_join);
+    check(mock.saves == 1 && mock.flash.channel == 11);
+
+    return 0;
+}
+
+static int test_invalid()
+{
+    /* A cache for another network, or a broken one, is ignored. */
+
+    check(!boot("other"));
+    check(mock.scans == 1 && mock.joins == 1);
+    check(mock.saves == 1 && !strcmp(mock.flash.ssid, "other"));
+
+    mock.flash.sum ^= 1;
+
+    check(!boot("other"));
+    check(mock.scans == 1 && mock.joins == 1);
+    check(mock.saves == 1);
+
+    return 0;
+}
+
+static int test_gone()
+{
+    /* Without the access point, the cached join fails, and so does the
+       scan. The cache stays for when it comes back. */
+
+    mock.ap_present = false;
+
+    check(boot("other") == ENOENT);
+    check(mock.scans == 1 && mock.joins == 1);
+    check(mock.saves == 0 && mock.flash.magic);
+
+    mock.ap_present = true;
+
+    check(!boot("other"));
+    check(net.w_fast_join);
+
+    return 0;
+}
+
+static int test_dhcp()
+{
+    struct dhcp_msg msg;
+    u16 len;
+
+    /* After a cached join, DHCP asks for the address from the last lease,
+       but only in DISCOVER. */
+
+    len = 10;
+    wifi_dhcp_options(net.iface, DHCP_DISCOVER, &msg, &len);
+    check(len == 16);
+    check(msg.options[10] == DHCP_OPTION_REQUESTED_IP
+          && msg.options[11] == 4);
+    check(!memcmp(&msg.options[12], &mock.flash.addr, 4));
+
+    len = 10;
+    wifi_dhcp_options(net.iface, DHCP_REQUEST, &msg, &len);
+    check(len == 10);
+
+    return 0;
+}
+
+#endif /* MICRON_CONFIG_NET_WIFI_CACHE */
+
+int main()
+{
+    _mem_init();
+
+    /* The loopback backend provides the interface wifi_connect picks up. */
+
+    if (net_init()) {
+        printf("net_init failed\n");
+        return 1;
+    }
+
+    mock.ap_present = true;
+    memcpy(mock.ap_bssid, "\x02\x00\x00\x00\x00\x01", 6);
+    mock.ap_channel = 6;
+
+    if (test_cold())
+        return 1;
+
+#if MICRON_CONFIG_NET_WIFI_CACHE
+    if (test_cached() || test_moved() || test_invalid() || test_gone()
+        || test_dhcp())
+        return 1;
+#endif
+
+    printf("ok\n");
+    return 0;
+}